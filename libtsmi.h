@@ -81,6 +81,21 @@ void init_screen_globals(int screen_w, int screen_h);
  */
 void init_game(int window_h, int window_w, char* title, int fps);
 
+/**
+    Use instead of init_game to run without a window (tests, benchmarks, servers...). libtcod's 
+    root console is never made, so SDL isn't needed. render draws into its own buffer instead - 
+    read it with render_buffer. Call init_screen_globals first.
+ */
+void init_headless();
+
+/**
+    Makes everything libtsmi does at random (tile shades, the fill functions, dungeon generation)
+    come from a generator seeded with seed, so the same calls make the same level every time.
+    Can be called before or after init_game / init_headless, and again to start over. Without it
+    libtcod's shared generator is used.
+ */
+void set_random_seed(guint32 seed);
+
 /** Checks for keypresses in realtime. */
 void check_key();
 
@@ -149,6 +164,8 @@ typedef struct{
     The base unit of a level - the smallest quanta of discrete roguelike gameplay.
     Note that each Tile is fundamentally tiled to its TileSeed - if a TileSeed is destroyed then the
     behaviour of all its Tiles is undefined.
+    
+    Levels don't store Tiles any more (see Cell), get_tile builds one on demand.
 */
 typedef struct {
     //these are the only fields of the struct that need be mutable. I may consider making this a
@@ -173,6 +190,72 @@ typedef struct {
     const TCOD_color_t* night_vis; 
 } Tile;
 
+/**
+    @struct Cell
+    
+    What a level actually stores for each tile. Everything a Tile holds can be worked out from the
+    TileSeed and the colour variation, so there's no point keeping 40 bytes a tile when 4 will do.
+ */
+typedef struct {
+    /** Index of the tile's TileSeed in the level palette. 0 is always NULL_TILE_COMMON. */
+    guint16 seed;
+    /** 
+        Where the day colours fall between the seed's min and max interpolation values (0 is min, 
+        255 is max). The same value is used for both the normal and the visible colours.
+     */
+    guint8 shade;
+}Cell;
+
+/** Width and height of a Chunk, in tiles. Must be a power of two. */
+#define CHUNK_SIZE  32
+/** log2 of CHUNK_SIZE */
+#define CHUNK_SHIFT 5
+
+/**
+    @struct Chunk
+    
+    A CHUNK_SIZE x CHUNK_SIZE square of cells, stored row by row. Chunked levels are made of these.
+ */
+typedef struct {
+    Cell cells[CHUNK_SIZE * CHUNK_SIZE];
+}Chunk;
+
+/** How a Level lays out its cells in memory. */
+enum LevelStorage {
+    /** One flat row-major array covering the whole level. */
+    LEVEL_FLAT,
+    /** A grid of Chunks, each only allocated the first time a tile inside it is set. */
+    LEVEL_CHUNKED,
+    /** 
+        Like LEVEL_CHUNKED, but only a fixed number of chunks are kept in memory. The least 
+        recently used ones are written out to a page file to make room, and read back on demand.
+     */
+    LEVEL_PAGED
+};
+
+/** 
+    Counters for the chunk cache of a LEVEL_PAGED level, for working out how big the cache should 
+    be.
+ */
+typedef struct {
+    /** Accesses to a chunk that was already in memory */
+    guint64 hits;
+    /** Accesses that had to bring a chunk into memory (reading it back or allocating it fresh) */
+    guint64 misses;
+    /** Chunks pushed out of memory to make room for another */
+    guint64 evictions;
+    /** Chunks read back from the page file */
+    guint64 reads;
+    /** Chunks written out to the page file */
+    guint64 writes;
+}ChunkCacheStats;
+
+/* Bookkeeping for LEVEL_PAGED levels, private to tsmi.c */
+struct ChunkCache;
+
+/** How many transparency/walkability changes a Level remembers the location of. */
+#define LEVEL_JOURNAL_SIZE 256
+
 /**
     @struct Level
     
@@ -180,12 +263,90 @@ typedef struct {
     overworld, or a level of a dungeon.
  */ 
 typedef struct {
-    /** The tiles that form this level. Though a 2d structure it is stored in a flat array. */
-    Tile* tiles;
+    /** Which of the fields below hold the tiles */
+    enum LevelStorage storage;
+    
+    /** 
+        The tiles that form this level (LEVEL_FLAT only). Though a 2d structure it is stored in a 
+        flat array, row by row, stride cells apart. This points at tile 0, 0 - if the level has a 
+        border, the null tiles around it are at negative offsets and past the end of each row.
+     */
+    Cell* cells;
+    /** Width of the sentinel ring of null tiles around a LEVEL_FLAT level (0 for none) */
+    int border;
+    /** Distance between rows of cells, ie width + 2 * border */
+    int stride;
+    
+    /** 
+        The tiles that form this level (LEVEL_CHUNKED and LEVEL_PAGED), as a row-major grid of 
+        chunks. NULL entries have never been written to, and read as the null tile - or for 
+        LEVEL_PAGED, may just not be in memory right now.
+     */
+    Chunk** chunks;
+    /** Width of the level in chunks */
+    int chunks_w;
+    /** Height of the level in chunks */
+    int chunks_h;
+    /** How many chunks have actually been allocated */
+    int chunks_allocated;
+    /** The chunks in memory and the page file behind them (LEVEL_PAGED only) */
+    struct ChunkCache* cache;
+    
     /** Width of the level, in tiles */
     int width;
     /** Height of the level, in tiles */
     int height;
+    
+    /** Every TileSeed used on this level, indexed by Cell::seed. */
+    const TileSeed** palette;
+    /** Number of TileSeeds in the palette */
+    int palette_size;
+    /** Number of TileSeeds the palette has room for before it has to grow */
+    int palette_capacity;
+    /** Maps TileSeed::type to a palette index, so set_tile doesn't have to search the palette */
+    guint16* palette_lookup;
+    /** Length of palette_lookup */
+    int palette_lookup_size;
+    
+    /** Number of 64 bit words in one row of a bitplane */
+    int row_words;
+    /** Bitplane of Tile::visible, one bit per tile, each row starting on a fresh word */
+    guint64* visible;
+    /** Bitplane of Tile::seen, laid out the same as visible */
+    guint64* seen;
+    /** 
+        Bitplane of tiles that can be seen through (not TileSeed::opaque), laid out the same as 
+        visible. set_tile keeps it up to date, so FOV never has to look at the tiles themselves.
+     */
+    guint64* transparent;
+    /** Bitplane of tiles that can be walked on (not TileSeed::solid), kept up to date by set_tile */
+    guint64* walkable;
+    
+    /** How many times a tile's transparency or walkability has changed, over the level's life */
+    guint64 epoch;
+    /** 
+        Where the last LEVEL_JOURNAL_SIZE of those changes happened. Change number n (counting from
+        0) is at journal[n % LEVEL_JOURNAL_SIZE].
+     */
+    Coord* journal;
+    /** How many times set_tile has been called on this level - any change to how it looks */
+    guint64 revision;
+    /** 
+        Different for every level made, so a cache keyed on it can't mistake a new level that got
+        an old one's address for the old one.
+     */
+    guint64 id;
+    
+    /** 
+        If true, set_tile works a tile's Cell::shade out from a hash of its position, its TileSeed
+        and shade_seed, rather than drawing it from the random number generator.
+     */
+    bool hashed_shades;
+    /** See hashed_shades */
+    guint32 shade_seed;
+    
+    /** How many times get_tile or get_tile_seed have been asked for a tile outside the level */
+    guint64 oob_reads;
 }Level;
 
 /**
@@ -201,6 +362,76 @@ typedef struct {
     int end_y;
 }Area;
 
+/**
+    @struct FovMask
+    
+    What a creature can see - a bitmask over a rectangle of its level, one bit per tile, set if the
+    tile is in view. Rows are packed into 64 bit words the same way as the Level bitplanes.
+ */
+typedef struct {
+    /** Level coordinates of the top left corner of the mask */
+    int x;
+    int y;
+    /** Size of the mask, in tiles */
+    int width;
+    int height;
+    /** Number of 64 bit words in one row */
+    int row_words;
+    guint64* bits;
+    /** 
+        Goes up every time the mask is worked out again, so render can tell when it hasn't 
+        changed. Bump it if you change a mask yourself.
+     */
+    guint64 version;
+    /** 
+        Different for every creature's mask, so render can't take a new creature's mask that got
+        an old one's address for the old one. 0 for masks that aren't a creature's.
+     */
+    guint64 id;
+}FovMask;
+
+/** How well compute_fov's per-creature caching is doing, across all creatures */
+typedef struct {
+    /** Calls that handed back the creature's previous visibility unchanged */
+    guint64 hits;
+    /** Calls that had to work the field of view out again */
+    guint64 misses;
+    /** Octants shadowcast by those calls */
+    guint64 octants_cast;
+    /** Octants incremental FOV could keep from last time instead */
+    guint64 octants_reused;
+}FovCacheStats;
+
+/** 
+    @struct ScreenCell
+    
+    One cell of what render draws - see render_buffer.
+ */
+typedef struct {
+    char         sym;
+    TCOD_color_t fore;
+    TCOD_color_t back;
+    /** Always 0, so a cell is 8 bytes that can be compared in one go */
+    char         unused;
+}ScreenCell;
+
+/** What render has been putting on the console */
+typedef struct {
+    /** Calls to render or render_with_fov */
+    guint64 frames;
+    /** Frames that came out exactly the same as the one before, so put nothing at all */
+    guint64 idle_frames;
+    /** Screen cells worked out, over all frames (the rest were kept from the frame before) */
+    guint64 cells_drawn;
+    /** Console cells put, over all frames */
+    guint64 cells_touched;
+    /** Console cells put by the last frame */
+    int last_cells_touched;
+}RenderStats;
+
+/* What incremental FOV remembers for a creature, private to tsmi.c */
+struct FovMemory;
+
 typedef struct {
     //These three fields should be const, but having a "creation" function forbades this:/
     char sym;
@@ -213,9 +444,45 @@ typedef struct {
     int x;
     int y;    
     
-    TCOD_map_t fov;
+    /** 
+        How far either side of the way it's facing a creature can see with directional FOV, in 
+        degrees. 90 (the default) is everything in front of it, 180 or more is all the way round.
+     */
+    float fov_half_width;
     
     Level* current_level;
+    
+    /* 
+        What visibility was last worked out for - the level (by its id), the top left of the 
+        window, how far into the level journal it was, and the creature's settings at the time. If
+        none of it has changed compute_fov doesn't need to do anything. fov_cached is false until
+        the first time.
+     */
+    bool fov_cached;
+    guint64 fov_level_id;
+    int fov_x;
+    int fov_y;
+    guint64 fov_epoch;
+    bool fov_cached_directional;
+    enum Direction fov_cached_direction;
+    short fov_cached_radius;
+    float fov_cached_half_width;
+    
+    /**
+        If true, compute_fov remembers what the creature saw octant by octant, and afterwards 
+        only redoes the octants where something has changed - a tile they looked at becoming more
+        or less transparent, or the cone moving across them. That holds when the creature moves 
+        too: after a step, an octant is kept if the tiles it looked at are the same relative to 
+        the creature as before, as in open ground or walking along a corridor. Where steps keep 
+        changing nearly everything it goes back to plain scans for a while, so it costs little 
+        more than without. Good for a big radius. Off by default, as it costs about seventeen 
+        masks' worth of memory. Ignored with TSMI_SCALAR_FOV.
+     */
+    bool incremental_fov;
+    struct FovMemory* fov_memory;
+    
+    /** What the creature could see the last time compute_fov was called for it */
+    FovMask visibility;
 }Creature;
 
 /***************
@@ -273,8 +540,71 @@ TileSeed* create_tile_common(char sym,
                                float min,
                                float max); 
 
+/** 
+    @return 
+        A copy of the tile at x, y. Outside the level this is the null tile, and the level's 
+        oob_reads counter goes up.
+ */
 Tile get_tile(Level* l, guint x, guint y);
+/** Like get_tile, but just returns the TileSeed - no copying, no colours worked out. */
+const TileSeed* get_tile_seed(Level* l, int x, int y);
+void set_tile(Level *l, guint x, guint y, const TileSeed *tc);
 bool walkable_p(Level* l, guint x, guint y);
+bool transparent_p(Level* l, int x, int y);
+
+/**
+    Answers a whole array of "can from[i] see to[i]" questions in one go, writing the answers to 
+    out[i]. Each is a walk along libtcod's Bresenham line (TCOD_line) between the two, which stops
+    at the first opaque tile. The end tiles themselves never block, and the world outside the 
+    level is opaque.
+    
+    Much cheaper than a compute_fov when all that matters is whether one creature can see 
+    another. Safe to call from any thread, as long as the level isn't being changed.
+ */
+void los_batch(Level* l, const Coord* from, const Coord* to, int count, bool* out);
+
+/*
+    Unchecked accessors, for callers that have already clipped their coordinates to the level.
+    Nothing is copied, and going outside the level (plus its border, if it has one) is undefined 
+    behaviour.
+    
+    NOTE: on LEVEL_PAGED levels the returned pointers are only good until the next access to the
+    level, since that might push the chunk back out to the page file.
+*/
+
+/* What unallocated chunks read as. */
+extern const Cell NULL_CELL;
+/* Used by the accessors below - looks a chunk up in a LEVEL_PAGED level, paging it in if needed. */
+Chunk* level_paged_chunk(Level* l, int chunk, bool for_write);
+
+static inline const Cell* get_cell_unchecked(Level* l, int x, int y) {
+    if (l->storage == LEVEL_FLAT)
+        return &l->cells[x + y * l->stride];
+    
+    int index = (x >> CHUNK_SHIFT) + (y >> CHUNK_SHIFT) * l->chunks_w;
+    const Chunk* chunk = (l->storage == LEVEL_PAGED) ? level_paged_chunk(l, index, false) 
+                                                     : l->chunks[index];
+    if (chunk == NULL)
+        return &NULL_CELL;
+    
+    return &chunk->cells[(x & (CHUNK_SIZE - 1)) + (y & (CHUNK_SIZE - 1)) * CHUNK_SIZE];
+}
+
+static inline const TileSeed* get_tile_seed_unchecked(Level* l, int x, int y) {
+    return l->palette[get_cell_unchecked(l, x, y)->seed];
+}
+
+static inline bool bitplane_get(const guint64* plane, int row_words, int x, int y) {
+    return (plane[y * row_words + (x >> 6)] >> (x & 63)) & 1;
+}
+
+static inline bool walkable_unchecked_p(Level* l, int x, int y) {
+    return bitplane_get(l->walkable, l->row_words, x, y);
+}
+
+static inline bool transparent_unchecked_p(Level* l, int x, int y) {
+    return bitplane_get(l->transparent, l->row_words, x, y);
+}
 
 void one_tile_fill(Area* a, const TileSeed* tc);
 
@@ -291,10 +621,25 @@ void veg_pattern_fill(Area* a,
 
 void cellular_automata(Area* a, TileSeed *tile_a, TileSeed *tile_b, int sum_a, int sum_b);           
 
+/** Digs rectangular rooms (of null tiles) out of the given rectangle, using a libtcod BSP tree. */
+void rectangular_dungeon_fill(Level* l, guint start_x, guint start_y, guint end_x, guint end_y);
+
 /**********************
     RENDERING & FOV
 **********************/
 
+/** 
+    log2 of how many different shades of each TileSeed render draws (1 to 8). A tile's 
+    Cell::shade is rounded to the nearest of them, so render only has to work out that many 
+    colours per TileSeed each time the time of day changes. At 5 bits a colour is at most 4/255
+    of the seed's colour range out. get_tile still gives the exact colours.
+ */
+#ifndef TSMI_SHADE_BITS
+#define TSMI_SHADE_BITS 5
+#endif
+/** Number of shades render draws of each TileSeed */
+#define TSMI_SHADE_LEVELS (1 << TSMI_SHADE_BITS)
+
 /**
     @param l
         Level to be rendered.
@@ -313,14 +658,248 @@ void cellular_automata(Area* a, TileSeed *tile_a, TileSeed *tile_b, int sum_a, i
         If false, the FOV will simply be a disc centered on the player.
 */
 void render(Level* l, Coord* camera, Creature * pc, float time, bool fog_of_war, bool directional);
+
+/**
+    Works out what a creature can currently see, without rendering anything. 
+    
+    @param directional
+        If true, the creature only sees within fov_half_width degrees of the direction it is 
+        facing. If false, the FOV will simply be a disc centered on the creature.
+    @return
+        The creature's visibility mask (the same as &c->visibility), good until the next 
+        compute_fov for this creature.
+        
+    Only the (2 * radius + 1) square around the creature is looked at, or a screen sized one for
+    a radius of 0, so this is cheap for creatures that can't see far and works anywhere on the 
+    level.
+    
+    If the creature hasn't moved, turned or changed radius, and nothing in its surroundings has 
+    become more or less transparent, the last result is handed back without recomputing.
+ */
+const FovMask* compute_fov(Creature* c, bool directional);
+
+/**
+    compute_fov for a whole array of creatures at once, spread over a pool of worker threads (one
+    fewer than there are cores - the calling thread works too). The pool is started the first
+    time this is called. Afterwards each creature's visibility is up to date.
+    
+    The creatures' levels are only read, and must not be changed until this returns. Each 
+    creature should only be in the array once. Like compute_fov, only call this from one thread.
+ */
+void compute_fov_batch(Creature** creatures, int count, bool directional);
+
+/** Stops the compute_fov_batch worker threads. They are started again if needed. */
+void stop_fov_workers(void);
+
+FovCacheStats fov_cache_stats(void);
+void fov_reset_cache_stats(void);
+
+/**
+    Renders the level like render, but takes the PC's field of view as given rather than working 
+    it out. Handy when the PC hasn't moved or turned and the terrain hasn't changed, or if FOV is
+    done elsewhere (another thread...).
+    
+    @param fov
+        What the PC can see, usually from compute_fov.
+ */
+void render_with_fov(Level* l, Coord* camera, Creature* pc, const FovMask* fov, float time, 
+                     bool fog_of_war);
+
+/**
+    render_with_fov, but with the drawing done on a render thread (started the first time this is
+    called), so the game can get on with the next turn meanwhile. What the frame needs from the 
+    level and the PC is copied before this returns - after that they, and the FOV mask, can be 
+    changed freely. Finish the frame with render_end.
+    
+    Until then, nothing else may draw on the root console or flush it. Only call this from one
+    thread.
+ */
+void render_begin(Level* l, Coord* camera, Creature* pc, const FovMask* fov, float time, 
+                  bool fog_of_war);
+
+/** Waits for the frame render_begin started to be drawn - call before flushing the console. */
+void render_end(void);
+
+/** Stops the render_begin thread. It's started again if needed. */
+void stop_render_thread(void);
+
+/**
+    render remembers what it last drew, and only puts console cells that have changed since. If 
+    anything else draws on the root console (or clears it), call this so the next frame is put in
+    full.
+ */
+void render_invalidate(void);
+
+/**
+    @return 
+        What the last render drew, SCREEN_W * SCREEN_H cells row by row - the same as the root 
+        console holds, unless something else has drawn on it since. NULL if nothing has been 
+        rendered yet (or since render_invalidate). Good until the next render.
+ */
+const ScreenCell* render_buffer(void);
+
+RenderStats render_stats(void);
+void render_reset_stats(void);
+
+/**
+    render_end, then TCOD_console_flush (nothing, with init_headless). The same as calling them
+    yourself, except the flush is timed for profile_stats.
+ */
+void flush_frame(void);
+
+/**************
+    PROFILING
+**************/
+
+/** How many of the latest runs of each phase profile_stats looks at. */
+#ifndef TSMI_PROFILE_WINDOW
+#define TSMI_PROFILE_WINDOW 256
+#endif
+
+/** The parts of the engine profile_stats times. */
+enum ProfilePhase {
+    /** compute_fov reading the level's transparency around the creature */
+    PROFILE_FOV_BUILD,
+    /** compute_fov casting the octants */
+    PROFILE_FOV_COMPUTE,
+    /** render copying what the frame needs out of the level */
+    PROFILE_SNAPSHOT,
+    /** render working out what each screen cell looks like */
+    PROFILE_SHADE,
+    /** render putting the changed cells on the console */
+    PROFILE_CONSOLE_WRITE,
+    /** TCOD_console_flush, through flush_frame */
+    PROFILE_FLUSH,
+    /** Each of the fill / generation functions */
+    PROFILE_GENERATION,
+    PROFILE_PHASES
+};
+
+/** How long a phase has been taking, in nanoseconds. */
+typedef struct {
+    /** Times the phase has run since profile_reset */
+    guint64 count;
+    /** The rest are over the last TSMI_PROFILE_WINDOW runs (or all of them, if fewer) */
+    guint64 min_ns;
+    guint64 mean_ns;
+    guint64 p99_ns;
+}PhaseStats;
+
+/**
+    Fills stats[phase] for every ProfilePhase. The phases are only timed if libtsmi was built
+    with TSMI_PROFILE defined - otherwise the timers compile to nothing and this gives all zeros.
+
+    Runs on worker and render threads are counted too. This can be called while they are running,
+    though a sample being written at the time may be missed.
+ */
+void profile_stats(PhaseStats stats[PROFILE_PHASES]);
+
+/** Forgets all the timings so far. Nothing else should be running engine code at the time. */
+void profile_reset(void);
+
+/** How many of its latest spans each thread keeps for trace_dump. */
+#ifndef TSMI_TRACE_EVENTS
+#define TSMI_TRACE_EVENTS 16384
+#endif
+/** Threads past this many aren't traced. */
+#ifndef TSMI_TRACE_THREADS
+#define TSMI_TRACE_THREADS 64
+#endif
+
+/**
+    Writes what the engine has been doing to a file, in the Chrome trace event format - open it
+    in chrome://tracing or ui.perfetto.dev. Each render, FOV computation, generation call etc. is
+    a span, on the thread it ran on (the game's, a FOV worker or the render thread).
+
+    Spans are only recorded if libtsmi was built with TSMI_TRACE defined - otherwise recording
+    compiles to nothing, and this writes nothing and returns false. Call it from the game's
+    thread; it waits for a render_begin frame to finish first.
+
+    @return False if the file couldn't be written.
+ */
+bool trace_dump(const char* path);
+
+/** Forgets all the spans so far. Call from the game's thread, like trace_dump. */
+void trace_clear(void);
+
+/** @return Whether the tile at level coordinates x, y is in the mask. */
+static inline bool fov_mask_get(const FovMask* m, int x, int y) {
+    x -= m->x;
+    y -= m->y;
+    
+    if ((unsigned)x >= (unsigned)m->width || (unsigned)y >= (unsigned)m->height)
+        return false;
+    
+    return bitplane_get(m->bits, m->row_words, x, y);
+}
                             
 /************
     LEVEL
 ************/ 
 
 Level* create_level(int height, int width);
+
+/** Widest sentinel border create_padded_level will make. */
+#define MAX_LEVEL_BORDER 2
+
+/**
+    Creates a LEVEL_FLAT level with a ring of null tiles around it, that can be read but never set.
+    Neighbourhood code (cellular automata, tree spacing...) can then look up to border tiles past 
+    the edge of the level without any bounds checks.
+    
+    @param border
+        Width of the ring, 0 to MAX_LEVEL_BORDER. 0 is the same as create_level.
+ */
+Level* create_padded_level(int width, int height, int border);
+
+/**
+    Creates a LEVEL_CHUNKED level. Nothing is allocated for the tiles until they are set, so this
+    costs the same however big the level is, and a sparse overworld only pays for the chunks that
+    actually have something in them. Otherwise it behaves exactly like a level from create_level.
+ */
+Level* create_chunked_level(int width, int height);
+
+/**
+    Creates a LEVEL_PAGED level, for overworlds too big to keep in memory. get_tile, set_tile,
+    render etc. all work as normal, chunks are faulted in from the page file as they are touched.
+    
+    Only the cells are paged - the per-tile bitplanes (visible, seen, transparent, walkable) stay 
+    in memory, at 1/8th of the size of the cells.
+    
+    @param max_chunks
+        How many chunks (CHUNK_SIZE * CHUNK_SIZE tiles, 4kB each) may be in memory at once.
+    @param page_file
+        Path of the file chunks are paged out to. It is created or truncated. If NULL an anonymous
+        temporary file is used.
+ */
+Level* create_paged_level(int width, int height, int max_chunks, const char* page_file);
+
+/**
+    From now on, set_tile picks each tile's colour variation with a hash of the tile's position, 
+    its TileSeed and seed, rather than the random number generator. Filling the level then 
+    doesn't touch the generator at all, and the same seed always gives the same colours, whatever
+    order the tiles are set in. Tiles already set keep their colours.
+ */
+void level_set_shade_seed(Level* l, guint32 seed);
+
+/** Writes every modified chunk in memory out to the page file (LEVEL_PAGED only). */
+void level_sync(Level* l);
+
+/** @return The chunk cache counters of a LEVEL_PAGED level (all zero for other levels). */
+ChunkCacheStats level_cache_stats(Level* l);
+void level_reset_cache_stats(Level* l);
+
 void delete_level(Level* l);
 
+/**
+    Creates a libtcod path finder that works straight off the level's walkability bitplane, so it
+    never goes out of date as tiles change. Free it with TCOD_path_delete.
+    
+    @param diagonal_cost
+        Cost of a diagonal step, relative to an orthogonal one (libtcod suggests 1.41).
+ */
+TCOD_path_t create_level_path(Level* l, float diagonal_cost);
+
 /**********
     BSP
 **********/
@@ -17,14 +17,26 @@
     along with libtsmi.  If not, see <http://www.gnu.org/licenses/>.
 ***************************************************************************************************/
 
+//For fseeko (and clock_gettime), with a 64 bit off_t even on 32 bit systems
+#define _POSIX_C_SOURCE 200112L
+#define _FILE_OFFSET_BITS 64
+
 #include <assert.h>
 #include <glib.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/types.h>
+
+#if defined(TSMI_PROFILE) || defined(TSMI_TRACE)
+#include <time.h>
+#endif
+
 #include "libtsmi.h"
+#include "libtcod_int.h"
 
 /********************************
     INITIALISATIONS && INPUT
@@ -41,6 +53,9 @@ static int SCREEN_H;
 //If I try and initialise values that rely on unintialised values, lols will happen
 bool screen_globals_init_p = false;
 
+//Set by init_headless - there's no libtcod root console, render just fills its own buffer
+static bool headless = false;
+
 //So I can initialise all these values once rather than constantly passing them as paramaters from
 //outside the lib.
 void init_screen_globals(int screen_w, int screen_h) {
@@ -54,13 +69,30 @@ void init_game (int window_h, int window_w, char* title, int frames) {
     assert(screen_globals_init_p);
     assert((window_w >= SCREEN_W) && (window_h >= SCREEN_H));
     
-    SEED = TCOD_random_get_instance(); //I guess now would be a good time lol
+    //I guess now would be a good time lol (unless set_random_seed already has)
+    if (SEED == NULL)
+        SEED = TCOD_random_get_instance();
     TCOD_console_set_keyboard_repeat(1, (1000/frames)); //so no delay when holding down a key.
    
     TCOD_console_init_root(window_w, window_h, title, false);
     TCOD_sys_set_fps(frames); 
 }
 
+void init_headless() {
+    assert(screen_globals_init_p);
+    
+    if (SEED == NULL)
+        SEED = TCOD_random_get_instance();
+    headless = true;
+}
+
+void set_random_seed(guint32 seed) {
+    if (SEED != NULL && SEED != TCOD_random_get_instance())
+        TCOD_random_delete(SEED);
+    
+    SEED = TCOD_random_new_from_seed(TCOD_RNG_CMWC, seed);
+}
+
 /*
 void clean_up() {
     //TODO: some way of cleaning up TileCommons created in host language
@@ -72,6 +104,299 @@ void check_key() {
     TCOD_console_check_for_keypress(TCOD_KEY_PRESSED);
 }
 
+/**************************
+    PROFILING & TRACING
+**************************/
+
+#if defined(TSMI_PROFILE) || defined(TSMI_TRACE)
+static guint64 monotonic_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    
+    return (guint64)t.tv_sec * G_GUINT64_CONSTANT(1000000000) + (guint64)t.tv_nsec;
+}
+#endif
+
+/*
+    With TSMI_PROFILE, each phase keeps the times of its last TSMI_PROFILE_WINDOW runs in a ring.
+    FOV runs on the worker threads and drawing on the render thread, so a run claims its slot with
+    an atomic add rather than a lock. Without TSMI_PROFILE, PROFILE_START and PROFILE_STOP are
+    nothing at all.
+*/
+#ifdef TSMI_PROFILE
+
+typedef struct {
+    //Runs so far - the next one goes in samples[next % TSMI_PROFILE_WINDOW]
+    guint64 next;
+    guint64 samples[TSMI_PROFILE_WINDOW];
+}PhaseRing;
+
+static PhaseRing phase_rings[PROFILE_PHASES];
+
+#ifdef __GNUC__
+#define PROFILE_LOAD(p)        __atomic_load_n(p, __ATOMIC_RELAXED)
+#define PROFILE_STORE(p, v)    __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define PROFILE_FETCH_ADD(p)   __atomic_fetch_add(p, 1, __ATOMIC_RELAXED)
+#else
+//Only good for one thread
+#define PROFILE_LOAD(p)        (*(p))
+#define PROFILE_STORE(p, v)    (*(p) = (v))
+#define PROFILE_FETCH_ADD(p)   ((*(p))++)
+#endif
+
+static void profile_record(enum ProfilePhase phase, guint64 start) {
+    const guint64 taken = monotonic_ns() - start;
+    PhaseRing* r = &phase_rings[phase];
+    const guint64 slot = PROFILE_FETCH_ADD(&r->next);
+    
+    PROFILE_STORE(&r->samples[slot % TSMI_PROFILE_WINDOW], taken);
+}
+
+static int compare_samples(const void* a, const void* b) {
+    const guint64 x = *(const guint64*)a;
+    const guint64 y = *(const guint64*)b;
+    
+    return (x > y) - (x < y);
+}
+
+#define PROFILE_START(name)       const guint64 profile_##name = monotonic_ns()
+#define PROFILE_STOP(phase, name) profile_record(phase, profile_##name)
+
+#else
+
+#define PROFILE_START(name)
+#define PROFILE_STOP(phase, name)
+
+#endif
+
+void profile_stats(PhaseStats stats[PROFILE_PHASES]) {
+    memset(stats, 0, PROFILE_PHASES * sizeof(PhaseStats));
+    
+#ifdef TSMI_PROFILE
+    guint64 sorted[TSMI_PROFILE_WINDOW];
+    
+    for (int p = 0; p < PROFILE_PHASES; p++) {
+        PhaseRing* r = &phase_rings[p];
+        const guint64 runs = PROFILE_LOAD(&r->next);
+        const int n = (int)MIN(runs, (guint64)TSMI_PROFILE_WINDOW);
+        
+        if (n == 0)
+            continue;
+        
+        guint64 sum = 0;
+        
+        for (int i = 0; i < n; i++) {
+            sorted[i] = PROFILE_LOAD(&r->samples[i]);
+            sum += sorted[i];
+        }
+        
+        qsort(sorted, n, sizeof(guint64), compare_samples);
+        
+        stats[p].count   = runs;
+        stats[p].min_ns  = sorted[0];
+        stats[p].mean_ns = sum / n;
+        //The smallest sample at least 99% of them are no bigger than
+        stats[p].p99_ns  = sorted[(n * 99 + 99) / 100 - 1];
+    }
+#endif
+}
+
+void profile_reset(void) {
+#ifdef TSMI_PROFILE
+    memset(phase_rings, 0, sizeof(phase_rings));
+#endif
+}
+
+/*
+    With TSMI_TRACE, each thread that runs engine code gets a ring of its last TSMI_TRACE_EVENTS
+    spans, claimed the first time it records one. Only the thread itself writes to its ring, so
+    recording is a couple of clock reads and a store, no locks or atomic adds. Threads libtsmi
+    starts give their ring back with TRACE_EXIT, and the next new thread carries on with it, so 
+    restarting the FOV workers doesn't use up more rings. trace_dump reads them all when the 
+    other threads are sure to be idle. Without TSMI_TRACE, the TRACE_ macros are nothing at all.
+*/
+#ifdef TSMI_TRACE
+
+#ifndef __GNUC__
+#error "TSMI_TRACE needs __thread and the __atomic builtins"
+#endif
+
+typedef struct {
+    //A string literal
+    const char* name;
+    guint64 start;
+    guint64 length;
+}TraceEvent;
+
+typedef struct {
+    //Spans so far - the next one goes in events[next % TSMI_TRACE_EVENTS]
+    guint64 next;
+    int tid;
+    const char* thread_name;
+    //Whether a thread has the ring
+    bool in_use;
+    TraceEvent events[TSMI_TRACE_EVENTS];
+}TraceRing;
+
+static TraceRing* trace_rings[TSMI_TRACE_THREADS];
+static int trace_threads = 0;
+static int trace_full_warned = 0;
+
+static __thread TraceRing* trace_ring = NULL;
+//Set on threads that came along while all the rings were taken - they aren't traced
+static __thread bool trace_untraced = false;
+
+static TraceRing* this_trace_ring(void) {
+    if (trace_ring != NULL || trace_untraced)
+        return trace_ring;
+    
+    int count = __atomic_load_n(&trace_threads, __ATOMIC_ACQUIRE);
+    
+    //One a thread that has finished gave back
+    for (int i = 0; i < count; i++) {
+        TraceRing* r = __atomic_load_n(&trace_rings[i], __ATOMIC_ACQUIRE);
+        bool taken = false;
+        
+        if (r != NULL && __atomic_compare_exchange_n(&r->in_use, &taken, true, false, 
+                                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            r->thread_name = NULL;
+            trace_ring = r;
+            return r;
+        }
+    }
+    
+    //Otherwise a new one, if there's room
+    do {
+        if (count >= TSMI_TRACE_THREADS) {
+            if (!__atomic_exchange_n(&trace_full_warned, 1, __ATOMIC_RELAXED))
+                g_warning("More than %d threads are tracing at once, the rest won't be traced\n",
+                          TSMI_TRACE_THREADS);
+            
+            trace_untraced = true;
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&trace_threads, &count, count + 1, false, 
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    
+    TraceRing* r = calloc(1, sizeof(TraceRing));
+    
+    if (r == NULL)
+        g_error("Could not allocate a trace ring");
+    
+    r->tid    = count + 1;
+    r->in_use = true;
+    __atomic_store_n(&trace_rings[count], r, __ATOMIC_RELEASE);
+    trace_ring = r;
+    
+    return r;
+}
+
+//Gives the calling thread's ring back for the next new thread, keeping what's in it
+static void trace_thread_exit(void) {
+    if (trace_ring != NULL)
+        __atomic_store_n(&trace_ring->in_use, false, __ATOMIC_RELEASE);
+    
+    trace_ring = NULL;
+}
+
+static void trace_record(const char* name, guint64 start) {
+    const guint64 end = monotonic_ns();
+    TraceRing* r = this_trace_ring();
+    
+    if (r == NULL)
+        return;
+    
+    const guint64 n = r->next;
+    r->events[n % TSMI_TRACE_EVENTS] = (TraceEvent){name, start, end - start};
+    __atomic_store_n(&r->next, n + 1, __ATOMIC_RELEASE);
+}
+
+//Names the calling thread in the trace
+static void trace_thread_name(const char* name) {
+    TraceRing* r = this_trace_ring();
+    
+    if (r != NULL)
+        r->thread_name = name;
+}
+
+#define TRACE_START(name)        const guint64 trace_##name = monotonic_ns()
+#define TRACE_STOP(name, label)  trace_record(label, trace_##name)
+#define TRACE_THREAD(label)      trace_thread_name(label)
+#define TRACE_EXIT()             trace_thread_exit()
+
+#else
+
+#define TRACE_START(name)
+#define TRACE_STOP(name, label)
+#define TRACE_THREAD(label)
+#define TRACE_EXIT()
+
+#endif
+
+bool trace_dump(const char* path) {
+#ifdef TSMI_TRACE
+    //The FOV workers only run inside compute_fov_batch, so this leaves just the calling thread
+    render_end();
+    
+    FILE* f = fopen(path, "w");
+    
+    if (f == NULL)
+        return false;
+    
+    fprintf(f, "{\"traceEvents\":[");
+    
+    const int threads = MIN(__atomic_load_n(&trace_threads, __ATOMIC_RELAXED), TSMI_TRACE_THREADS);
+    bool first = true;
+    
+    for (int i = 0; i < threads; i++) {
+        const TraceRing* r = __atomic_load_n(&trace_rings[i], __ATOMIC_ACQUIRE);
+        
+        if (r == NULL)
+            continue;
+        
+        if (r->thread_name != NULL) {
+            fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                       "\"args\":{\"name\":\"%s\"}}", first ? "" : ",", r->tid, r->thread_name);
+            first = false;
+        }
+        
+        const guint64 n = __atomic_load_n(&r->next, __ATOMIC_ACQUIRE);
+        
+        for (guint64 k = (n > TSMI_TRACE_EVENTS) ? n - TSMI_TRACE_EVENTS : 0; k < n; k++) {
+            const TraceEvent* e = &r->events[k % TSMI_TRACE_EVENTS];
+            
+            //Chrome wants microseconds
+            fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                       "\"dur\":%.3f}", first ? "" : ",", e->name, r->tid, e->start / 1000.0,
+                    e->length / 1000.0);
+            first = false;
+        }
+    }
+    
+    fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    
+    return fclose(f) == 0;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+void trace_clear(void) {
+#ifdef TSMI_TRACE
+    render_end();
+    
+    const int threads = MIN(__atomic_load_n(&trace_threads, __ATOMIC_RELAXED), TSMI_TRACE_THREADS);
+    
+    for (int i = 0; i < threads; i++) {
+        TraceRing* r = __atomic_load_n(&trace_rings[i], __ATOMIC_ACQUIRE);
+        
+        if (r != NULL)
+            __atomic_store_n(&r->next, 0, __ATOMIC_RELEASE);
+    }
+#endif
+}
+
 /******************
     COORDINATES
 ******************/
@@ -89,6 +414,159 @@ Coord add_coords(Coord a, Coord b) {
     return c;
 }
 
+/*****************
+    BITPLANES
+*****************/
+
+//Level keeps per-tile flags in bitplanes: one bit per tile, rows padded to a whole 64 bit word.
+//Reading is bitplane_get, in libtsmi.h.
+static inline void bitplane_put(guint64* plane, int row_words, int x, int y, bool on) {
+    guint64* word = &plane[y * row_words + (x >> 6)];
+    guint64 mask  = G_GUINT64_CONSTANT(1) << (x & 63);
+    
+    if (on)
+        *word |= mask;
+    else
+        *word &= ~mask;
+}
+
+//Writes the bits of `bits` picked out by `mask` to a bitplane row, starting at bit `from` (which 
+//must be on the row) - the other way round to bitplane_bits. Mask bits past the row are ignored.
+static inline void put_bits(guint64* row, int row_words, int from, guint64 bits, guint64 mask) {
+    const int word  = from / 64;
+    const int shift = from % 64;
+    
+    bits &= mask;
+    row[word] = (row[word] & ~(mask << shift)) | (bits << shift);
+    
+    if (shift && word + 1 < row_words)
+        row[word + 1] = (row[word + 1] & ~(mask >> (64 - shift))) | (bits >> (64 - shift));
+}
+
+//Lowest and highest set bit of a word, which mustn't be 0.
+static inline int lowest_bit(guint64 w) {
+#ifdef __GNUC__
+    return __builtin_ctzll(w);
+#else
+    int n = 0;
+    
+    while (!(w & 1)) {
+        w >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+static inline int highest_bit(guint64 w) {
+#ifdef __GNUC__
+    return 63 - __builtin_clzll(w);
+#else
+    int n = 63;
+    
+    while (!(w >> 63)) {
+        w <<= 1;
+        n--;
+    }
+    return n;
+#endif
+}
+
+/*
+    The first bit set in line ^ flip going from bit `from` to bit `to` inclusive (either way 
+    round), or -1 if there isn't one. A flip of 0 looks for set bits, ~0 for clear ones.
+*/
+static inline int find_bit(const guint64* line, int from, int to, guint64 flip) {
+    const int last = to >> 6;
+    int w = from >> 6;
+    
+    if (from <= to) {
+        guint64 bits = (line[w] ^ flip) & (~G_GUINT64_CONSTANT(0) << (from & 63));
+        
+        while (true) {
+            if (w == last)
+                bits &= ~G_GUINT64_CONSTANT(0) >> (63 - (to & 63));
+            if (bits)
+                return w * 64 + lowest_bit(bits);
+            if (w == last)
+                return -1;
+            
+            bits = line[++w] ^ flip;
+        }
+    } else {
+        guint64 bits = (line[w] ^ flip) & (~G_GUINT64_CONSTANT(0) >> (63 - (from & 63)));
+        
+        while (true) {
+            if (w == last)
+                bits &= ~G_GUINT64_CONSTANT(0) << (to & 63);
+            if (bits)
+                return w * 64 + highest_bit(bits);
+            if (w == last)
+                return -1;
+            
+            bits = line[--w] ^ flip;
+        }
+    }
+}
+
+//Sets bits lo to hi inclusive.
+static inline void fill_bits(guint64* line, int lo, int hi) {
+    const int first = lo >> 6;
+    const int last  = hi >> 6;
+    const guint64 head = ~G_GUINT64_CONSTANT(0) << (lo & 63);
+    const guint64 tail = ~G_GUINT64_CONSTANT(0) >> (63 - (hi & 63));
+    
+    if (first == last) {
+        line[first] |= head & tail;
+    } else {
+        line[first] |= head;
+        for (int w = first + 1; w < last; w++)
+            line[w] = ~G_GUINT64_CONSTANT(0);
+        line[last] |= tail;
+    }
+}
+
+//64 bits of a bitplane row starting at bit `from`, which can be off either end (giving 0s there).
+static inline guint64 bitplane_bits(const guint64* row, int row_words, int from) {
+    const int word  = (from >= 0) ? from / 64 : -((63 - from) / 64);
+    const int shift = from - word * 64;
+    
+    const guint64 lo = (word >= 0 && word < row_words) ? row[word] : 0;
+    const guint64 hi = (word + 1 >= 0 && word + 1 < row_words) ? row[word + 1] : 0;
+    
+    return shift ? (lo >> shift) | (hi << (64 - shift)) : lo;
+}
+
+//Transposes a 64x64 block of bits in place: bit c of word r swaps with bit r of word c.
+static inline void transpose64(guint64 a[64]) {
+    guint64 any = 0;
+    
+    //Blocks of nothing are common enough (open ground, unchanged terrain) to be worth checking for
+    for (int r = 0; r < 64; r++)
+        any |= a[r];
+    
+    if (!any)
+        return;
+    
+    guint64 m = G_GUINT64_CONSTANT(0x00000000FFFFFFFF);
+    
+    for (int j = 32; j != 0; j >>= 1, m ^= m << j) {
+        for (int k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+            const guint64 t = ((a[k] >> j) ^ a[k | j]) & m;
+            a[k]     ^= t << j;
+            a[k | j] ^= t;
+        }
+    }
+}
+
+//Defined with the rest of the tile/level code further down
+static bool outside_world_p(Level* l, int x, int y);
+static const TileSeed* seed_at(Level* l, int x, int y);
+static TCOD_color_t day_colour(const TileSeed* tc, guint8 shade, bool visible);
+
+//With the rest of the FOV code
+static void delete_fov_memory(struct FovMemory* memory);
+
 /***************
     CREATURE
 ***************/
@@ -135,12 +613,14 @@ Level* creature_get_level(Creature* c) {
     return c->current_level;
 }
 
+//FovMask::id for the next creature made. 0 is never used, so it can mean not a creature's mask.
+static guint64 next_fov_mask_id = 1;
+
 //Convenience function that takes care of creating each creatures FOV map and the like
 Creature* create_creature(char sym, int x, int y, enum Direction direction,
                           TCOD_color_t fg, TCOD_color_t bg, short radius, Level* l) {
    
     Creature* c = malloc(sizeof(Creature));
-    TCOD_map_new(SCREEN_W, SCREEN_H);
 
     c->sym           = sym;
     c->fg            = fg;
@@ -151,14 +631,27 @@ Creature* create_creature(char sym, int x, int y, enum Direction direction,
     c->x             = x;
     c->y             = y;
     
-    c->fov           = TCOD_map_new(SCREEN_W, SCREEN_H);
+    c->fov_half_width = 90.0f;
+    
     c->current_level = l;
+    c->fov_cached    = false;
+    c->fov_level_id  = 0;
+    c->fov_x         = 0;
+    c->fov_y         = 0;
+    c->fov_epoch     = 0;
+    
+    c->incremental_fov = false;
+    c->fov_memory      = NULL;
+    
+    //Sized to fit the creature's radius by compute_fov
+    c->visibility = (FovMask){0, 0, 0, 0, 0, NULL, 0, next_fov_mask_id++};
 
     return c;
 }
 
 void delete_creature(Creature* v) {
-    TCOD_map_delete(v->fov);
+    delete_fov_memory(v->fov_memory);
+    free(v->visibility.bits);
     free(v);
 }
 
@@ -167,142 +660,1701 @@ void delete_creature(Creature* v) {
 **********************/
 
 /*
-    Supplied with a map from the host language. Seems the best way to do it, lots of FFI calls
-    would kill performance.
-
-    TODO: is currently hardcoded for the PC, ie expecting a player in the dead middle of the screen.
-    TODO: add a switch so it can be non-directional.
-*/    
-static void process_fov(Creature* c, int camera_x, int camera_y, bool directional) {    
-    
-    int start_x;
-    int end_x;
-    int start_y;
-    int end_y;
-    
-    if (directional) {
-        const int MID_X = SCREEN_W / 2;
-        const int MID_Y = SCREEN_H / 2;
-        
-        switch(c->direction) {
-            case North:
-                start_x = 0; 
-                end_x   = SCREEN_W;
-                start_y = 0;
-                end_y   = MID_Y;
-                break;
+    Octants, as the multipliers that take a scan's own coordinates (dx along a row, dy = -row) to
+    the level's: x = dx * xx + dy * xy, y = dx * yx + dy * yy. Same order as libtcod.
+*/
+static const int OCTANTS[8][4] = {
+    /* xx, xy, yx, yy */
+    { 1,  0,  0,  1},
+    { 0,  1,  1,  0},
+    { 0, -1,  1,  0},
+    {-1,  0,  0,  1},
+    {-1,  0,  0, -1},
+    { 0, -1, -1,  0},
+    { 0,  1, -1,  0},
+    { 1,  0,  0, -1}
+};
+
+//A range of slopes still to be scanned, start >= end
+typedef struct {
+    float start;
+    float end;
+}FovInterval;
+
+/*
+    Scratch space for the shadowcaster, grown as needed. The window's opacity is held a row per 
+    line, and transposed (a column per line) so the octants that go up and down columns can run
+    along lines of bits too. Those octants mark what they see in lit_t, to be transposed back at 
+    the end. Transposing goes 64x64 tiles at a time, and only for the blocks of the window an 
+    octant actually gets to - blocks says which.
+    
+    Each thread working out FOV needs its own. The scalar shadowcaster doesn't use it.
+*/
+typedef struct {
+    guint64* opaque;
+    guint64* opaque_t;
+    guint64* lit_t;
+    size_t   capacity;
+    
+    guint8*  blocks;
+    size_t   block_capacity;
+    
+    //How far along row j of an octant is within the radius
+    int*     reach;
+    int      reach_capacity;
+    
+    //Intervals for the row being scanned and the one after it
+    FovInterval* rows[2];
+    int          row_capacity;
+}FovScratch;
+
+//For compute_fov, on the game's own thread
+static FovScratch fov_scratch = {NULL, NULL, NULL, 0, NULL, 0, NULL, 0, {NULL, NULL}, 0};
+
+#ifdef TSMI_SCALAR_FOV
+
+//Things off the edge of the level block sight, same as walls.
+static inline bool fov_transparent_p(Level* l, int x, int y) {
+    return !outside_world_p(l, x, y) && transparent_unchecked_p(l, x, y);
+}
+
+/*
+    Recursive shadowcasting over one octant - libtcod's FOV_SHADOW, walls lit, but reading the 
+    level's transparency bitplane directly and writing into m (cx, cy is the creature, relative to 
+    the mask). Only the slopes between end and start (0.0 is the octant's axis, 1.0 its diagonal)
+    get scanned, which is how a cone is cut out. Tiles outside the mask aren't looked at.
+*/
+static void cast_light(Level* l, FovMask* m, int cx, int cy, int row, float start, float end, 
+                       int radius, int r2, const int* octant) {
+    
+    const int xx = octant[0];
+    const int xy = octant[1];
+    const int yx = octant[2];
+    const int yy = octant[3];
+    
+    float new_start = 0.0f;
+    
+    if (start < end)
+        return;
+    
+    for (int j = row; j < radius + 1; j++) {
+        const int dy = -j;
+        int dx = -j - 1;
+        bool blocked = false;
+        
+        while (dx <= 0) {
+            dx++;
+            
+            const int x = cx + dx * xx + dy * xy;
+            const int y = cy + dx * yx + dy * yy;
+            
+            if ((unsigned)x >= (unsigned)m->width || (unsigned)y >= (unsigned)m->height)
+                continue;
+            
+            const float l_slope = (dx - 0.5f) / (dy + 0.5f);
+            const float r_slope = (dx + 0.5f) / (dy - 0.5f);
             
-            case Northeast:           
-                start_x = MID_X; 
-                end_x   = SCREEN_W;
-                start_y = 0;
-                end_y   = MID_Y + 1;
+            if (start < r_slope)
+                continue;
+            else if (end > l_slope)
                 break;
             
-            case East:
-                start_x = MID_X + 1; 
-                end_x   = SCREEN_W;
-                start_y = 0;
-                end_y   = SCREEN_H;
-                break;
+            const bool transparent = fov_transparent_p(l, x + m->x, y + m->y);
+            
+            if (dx * dx + dy * dy <= r2)
+                bitplane_put(m->bits, m->row_words, x, y, true);
+            
+            if (blocked) {
+                if (!transparent) {
+                    new_start = r_slope;
+                    continue;
+                } else {
+                    blocked = false;
+                    start = new_start;
+                }
+            } else if (!transparent && j < radius) {
+                blocked = true;
+                cast_light(l, m, cx, cy, j + 1, start, l_slope, radius, r2, octant);
+                new_start = r_slope;
+            }
+        }
+        
+        if (blocked)
+            break;
+    }
+}
+
+#else
+
+/*
+    Slopes of the edges of tile k along row j of an octant (k tiles in from the axis), worked out 
+    exactly as libtcod does so the results come out identical.
+*/
+static inline float left_slope(int k, int j) {
+    const int dx = -k;
+    const int dy = -j;
+    return (dx - 0.5f) / (dy + 0.5f);
+}
+
+static inline float right_slope(int k, int j) {
+    const int dx = -k;
+    const int dy = -j;
+    return (dx + 0.5f) / (dy - 0.5f);
+}
+
+static void* grow_scratch(void* p, size_t size) {
+    p = realloc(p, size);
+    
+    if (p == NULL)
+        g_error("Could not allocate %lu bytes of FOV scratch space", (unsigned long)size);
+    
+    return p;
+}
+
+//Makes sure rows[0] and rows[1] can both hold count intervals
+static void reserve_intervals(FovScratch* s, int count) {
+    if (count <= s->row_capacity)
+        return;
+    
+    s->row_capacity = MAX(count, s->row_capacity * 2);
+    s->rows[0] = grow_scratch(s->rows[0], s->row_capacity * sizeof(FovInterval));
+    s->rows[1] = grow_scratch(s->rows[1], s->row_capacity * sizeof(FovInterval));
+}
+
+/*
+    Loads the opacity of the tiles under m into the scratch space (things off the level are 
+    opaque), and works out the reach of each row for the radius.
+*/
+static void prepare_scratch(FovScratch* s, Level* l, const FovMask* m, int radius) {
+    const int col_words = (m->height + 63) / 64;
+    const size_t size   = MAX((size_t)m->row_words * m->height, (size_t)col_words * m->width);
+    const size_t blocks = (size_t)m->row_words * col_words;
+    
+    if (size > s->capacity) {
+        s->capacity = size;
+        s->opaque   = grow_scratch(s->opaque,   size * sizeof(guint64));
+        s->opaque_t = grow_scratch(s->opaque_t, size * sizeof(guint64));
+        s->lit_t    = grow_scratch(s->lit_t,    size * sizeof(guint64));
+    }
+    
+    if (blocks > s->block_capacity) {
+        s->block_capacity = blocks;
+        s->blocks = grow_scratch(s->blocks, blocks);
+    }
+    
+    memset(s->blocks, 0, blocks);
+    
+    if (radius + 1 > s->reach_capacity) {
+        s->reach_capacity = radius + 1;
+        s->reach = grow_scratch(s->reach, s->reach_capacity * sizeof(int));
+    }
+    
+    const int r2 = radius * radius;
+    
+    for (int j = 0; j <= radius; j++) {
+        int k = (int)sqrt(r2 - j * j);
+        
+        while (k * k + j * j > r2)
+            k--;
+        while ((k + 1) * (k + 1) + j * j <= r2)
+            k++;
+        
+        s->reach[j] = k;
+    }
+    
+    for (int y = 0; y < m->height; y++) {
+        const int level_y = m->y + y;
+        guint64* line = &s->opaque[(size_t)y * m->row_words];
+        
+        if (level_y < 0 || level_y >= l->height) {
+            memset(line, 0xFF, m->row_words * sizeof(guint64));
+            continue;
+        }
+        
+        const guint64* row = &l->transparent[(size_t)level_y * l->row_words];
+        
+        for (int w = 0; w < m->row_words; w++)
+            line[w] = ~bitplane_bits(row, l->row_words, m->x + w * 64);
+    }
+    
+    //Past the right hand edge of the window doesn't matter, but keep it tidy for comparing
+    if (m->width & 63) {
+        const guint64 tail = (G_GUINT64_CONSTANT(1) << (m->width & 63)) - 1;
+        
+        for (int y = 0; y < m->height; y++)
+            s->opaque[(size_t)y * m->row_words + m->row_words - 1] &= tail;
+    }
+}
+
+//Transposes the 64x64 block of opacity at block column bx, block row by, if it isn't already.
+static void need_column_block(FovScratch* s, const FovMask* m, int bx, int by) {
+    guint8* done = &s->blocks[by * m->row_words + bx];
+    
+    if (*done)
+        return;
+    
+    const int col_words = (m->height + 63) / 64;
+    guint64 block[64];
+    
+    for (int r = 0; r < 64; r++) {
+        const int y = by * 64 + r;
+        block[r] = (y < m->height) ? s->opaque[(size_t)y * m->row_words + bx] : 0;
+    }
+    
+    transpose64(block);
+    
+    for (int r = 0; r < 64 && bx * 64 + r < m->width; r++) {
+        const size_t word = (size_t)(bx * 64 + r) * col_words + by;
+        s->opaque_t[word] = block[r];
+        s->lit_t[word]    = 0;
+    }
+    
+    *done = true;
+}
+
+//ORs what the octants going along columns saw back into m.
+static void merge_column_blocks(FovScratch* s, FovMask* m) {
+    const int col_words = (m->height + 63) / 64;
+    guint64 block[64];
+    
+    for (int by = 0; by < col_words; by++) {
+        for (int bx = 0; bx < m->row_words; bx++) {
+            if (!s->blocks[by * m->row_words + bx])
+                continue;
+            
+            for (int r = 0; r < 64; r++) {
+                const int x = bx * 64 + r;
+                block[r] = (x < m->width) ? s->lit_t[(size_t)x * col_words + by] : 0;
+            }
+            
+            transpose64(block);
+            
+            for (int r = 0; r < 64 && by * 64 + r < m->height; r++)
+                m->bits[(size_t)(by * 64 + r) * m->row_words + bx] |= block[r];
+        }
+    }
+}
+
+/*
+    Shadowcasts one octant between slopes start and end, the same as cast_light but a whole row 
+    at a time. Each row holds a list of slope intervals still in sight: the tiles under an 
+    interval are lit in one go, and the runs of transparent tiles under it (found a word at a 
+    time) become the intervals for the next row out. These are exactly the recursive calls and 
+    carrying on that libtcod does, just done breadth first.
+*/
+static void scan_octant(FovScratch* s, const FovMask* m, guint64* lit, guint64* examined, 
+                        int cx, int cy, int radius, const int* octant, float start, float end) {
+    
+    //Octants either run along the window's rows or its columns. Either way, row j of the octant is
+    //line (centre_line - j * line_step) and tile k along it is bit (centre_bit - k * bit_step).
+    //What's seen gets marked in lit, laid out the same way, and if examined isn't NULL every tile
+    //whose opacity was looked at gets marked in that.
+    const bool along_rows  = (octant[1] == 0);
+    const int line_step    = along_rows ? octant[3] : octant[1];
+    const int bit_step     = along_rows ? octant[0] : octant[2];
+    const int centre_line  = along_rows ? cy : cx;
+    const int centre_bit   = along_rows ? cx : cy;
+    const int lines        = along_rows ? m->height : m->width;
+    const int line_length  = along_rows ? m->width : m->height;
+    const int words        = along_rows ? m->row_words : (m->height + 63) / 64;
+    const guint64* opaque  = along_rows ? s->opaque : s->opaque_t;
+    
+    //Rows and tiles past the edge of the window are never looked at
+    const int last_row = MIN(radius, (line_step > 0) ? centre_line : lines - 1 - centre_line);
+    const int widest   = (bit_step > 0) ? centre_bit : line_length - 1 - centre_bit;
+    
+    reserve_intervals(s, 1);
+    
+    FovInterval* current = s->rows[0];
+    int count = 0;
+    
+    if (start >= end)
+        current[count++] = (FovInterval){start, end};
+    
+    for (int j = 1; j <= last_row && count > 0; j++) {
+        const size_t line      = (size_t)(centre_line - j * line_step) * words;
+        const guint64* blocked = &opaque[line];
+        guint64* seen          = &lit[line];
+        guint64* looked_at     = (examined != NULL) ? &examined[line] : NULL;
+        const int longest      = MIN(j, widest);
+        
+        //Each interval splits into at most one more piece than it has opaque runs under it. Runs 
+        //are only shared between intervals at their ends, so there can't be more than this:
+        const int current_index = (current == s->rows[0]) ? 0 : 1;
+        reserve_intervals(s, 3 * count + j + 2);
+        current = s->rows[current_index];
+        FovInterval* next = s->rows[1 - current_index];
+        int next_count = 0;
+        
+        for (int i = 0; i < count; i++) {
+            float from    = current[i].start;
+            const float to = current[i].end;
+            
+            //The tiles the interval covers, furthest from the axis first
+            int hi = MIN(longest, (int)(from * (j + 0.5f) + 0.5f));
+            while (hi >= 0 && right_slope(hi, j) > from)
+                hi--;
+            while (hi < longest && right_slope(hi + 1, j) <= from)
+                hi++;
+            
+            int lo = MAX(0, (int)(to * (j - 0.5f) - 0.5f));
+            while (lo > 0 && left_slope(lo - 1, j) >= to)
+                lo--;
+            while (left_slope(lo, j) < to)
+                lo++;
+            
+            //No tiles under it. If that's the window's doing it stays that way, otherwise (the 
+            //interval can end up back to front partway along a row, which libtcod lets carry on)
+            //the interval gets another go on the next row.
+            if (lo > hi) {
+                if (lo <= longest && j < last_row)
+                    next[next_count++] = current[i];
+                continue;
+            }
+            
+            if (!along_rows) {
+                const int a = centre_bit - lo * bit_step;
+                const int b = centre_bit - hi * bit_step;
+                
+                for (int by = MIN(a, b) >> 6; by <= MAX(a, b) >> 6; by++)
+                    need_column_block(s, m, (centre_line - j * line_step) >> 6, by);
+            }
+            
+            if (looked_at != NULL) {
+                const int a = centre_bit - lo * bit_step;
+                const int b = centre_bit - hi * bit_step;
+                fill_bits(looked_at, MIN(a, b), MAX(a, b));
+            }
+            
+            const int lit_hi = MIN(hi, s->reach[j]);
+            
+            if (lo <= lit_hi) {
+                const int a = centre_bit - lo * bit_step;
+                const int b = centre_bit - lit_hi * bit_step;
+                fill_bits(seen, MIN(a, b), MAX(a, b));
+            }
+            
+            if (j == last_row)
+                continue;
+            
+            //Split the interval around the opaque runs under it
+            const int lo_bit = centre_bit - lo * bit_step;
+            int k = hi;
+            
+            while (true) {
+                const int wall = find_bit(blocked, centre_bit - k * bit_step, lo_bit, 0);
+                
+                if (wall < 0) {
+                    next[next_count++] = (FovInterval){from, to};
+                    break;
+                }
+                
+                const int wall_k = (centre_bit - wall) * bit_step;
+                const float wall_slope = left_slope(wall_k, j);
+                
+                if (from >= wall_slope)
+                    next[next_count++] = (FovInterval){from, wall_slope};
+                
+                const int gap = find_bit(blocked, wall, lo_bit, ~G_GUINT64_CONSTANT(0));
+                
+                if (gap < 0)
+                    break;
+                
+                k    = (centre_bit - gap) * bit_step;
+                from = right_slope(k + 1, j);
+            }
+        }
+        
+        current = next;
+        count   = next_count;
+    }
+}
+
+#endif
+
+//Compass bearing of an offset in degrees, clockwise from north (-y).
+static float bearing(int dx, int dy) {
+    return (float)(atan2(dx, -dy) * 180.0 / G_PI);
+}
+
+//An angle in degrees, brought into (-180, 180].
+static float wrap_degrees(float a) {
+    a = fmodf(a, 360.0f);
+    
+    if (a > 180.0f)
+        a -= 360.0f;
+    else if (a <= -180.0f)
+        a += 360.0f;
+    
+    return a;
+}
+
+/*
+    Works out which parts of an octant fall within half_width degrees of facing, as (start, end) 
+    slope pairs for cast_light. Returns how many there are: none if the cone misses the octant, 
+    and at most two (a cone wider than 270 degrees can leave a gap in the middle of one).
+*/
+static int cone_slopes(const int* octant, float facing, float half_width, float slopes[2][2]) {
+    //An angle t into the octant (0 to 45 degrees) is a slope of tan(t), and a bearing of
+    //axis + t or axis - t depending on which way round the octant goes.
+    const float axis     = bearing(-octant[1], -octant[3]);
+    const float diagonal = bearing(-octant[0] - octant[1], -octant[2] - octant[3]);
+    const float turn     = wrap_degrees(diagonal - axis) > 0.0f ? 1.0f : -1.0f;
+    const float centre   = turn * wrap_degrees(facing - axis);
+    
+    int pieces = 0;
+    
+    for (int wrap = -360; wrap <= 360; wrap += 360) {
+        const float lo = MAX(centre - half_width + wrap, 0.0f);
+        const float hi = MIN(centre + half_width + wrap, 45.0f);
+        
+        if (lo < hi) {
+            slopes[pieces][0] = (hi >= 45.0f) ? 1.0f : tanf(hi * (float)G_PI / 180.0f);
+            slopes[pieces][1] = (lo <= 0.0f)  ? 0.0f : tanf(lo * (float)G_PI / 180.0f);
+            pieces++;
+        }
+    }
+    
+    return pieces;
+}
+
+/*
+    What a creature with incremental_fov set saw last time, an octant at a time, along with the 
+    opacity of the window it was worked out from. The window is always centred on the creature, 
+    so everything here is relative to it: an octant's result only depends on the opacity of the 
+    tiles it looked at and the part of it the cone takes in, so if neither has changed it can be
+    used again as it is - whether that's because nothing around the creature changed, or because 
+    it took a step and what it looked at is the same one tile over (open ground, or the walls of
+    a corridor it's walking along).
+    
+    Where a step changes nearly everything anyway, remembering costs more than it saves, so after
+    steps that reuse less than a couple of octants, steps are scanned the plain way for a while 
+    (longer each time, up to FOV_MEMORY_MAX_BACKOFF) before trying again.
+*/
+struct FovMemory {
+    int width;
+    int height;
+    int radius;
+    bool valid;
+    
+    //Top left of the window the last scan was from, if there's been one
+    bool placed;
+    int x;
+    int y;
+    
+    //Steps still to scan without remembering, and how many to skip after the next one that 
+    //doesn't pay
+    int skip;
+    int backoff;
+    
+    guint64* opaque;
+    
+    //What each octant saw, and every tile it looked at, laid out the way scan_octant does: row 
+    //octants a row per line, column octants a column per line
+    guint64* octants[8];
+    guint64* examined[8];
+    
+    int pieces[8];
+    float slopes[8][2][2];
+};
+
+static void delete_fov_memory(struct FovMemory* memory) {
+    if (memory == NULL)
+        return;
+    
+    free(memory->opaque);
+    free(memory->octants[0]);
+    free(memory);
+}
+
+#ifndef TSMI_SCALAR_FOV
+
+//Most steps incremental FOV will scan the plain way before trying to remember again
+static const int FOV_MEMORY_MAX_BACKOFF = 32;
+
+//A creature's FovMemory, made fresh if it hasn't got one that fits the window.
+static struct FovMemory* fov_memory_for(Creature* c, const FovMask* m, int radius) {
+    struct FovMemory* memory = c->fov_memory;
+    
+    if (memory != NULL && memory->width == m->width && memory->height == m->height && 
+        memory->radius == radius)
+        return memory;
+    
+    delete_fov_memory(memory);
+    
+    memory = malloc(sizeof(struct FovMemory));
+    
+    if (memory == NULL)
+        g_error("Could not allocate FOV memory");
+    
+    memory->width        = m->width;
+    memory->height       = m->height;
+    memory->radius       = radius;
+    memory->valid        = false;
+    memory->placed       = false;
+    memory->skip         = 0;
+    memory->backoff      = 0;
+    const size_t opaque_size = (size_t)m->row_words * m->height;
+    const size_t size = MAX(opaque_size, (size_t)((m->height + 63) / 64) * m->width);
+    
+    memory->opaque     = malloc(opaque_size * sizeof(guint64));
+    memory->octants[0] = malloc(16 * size * sizeof(guint64));
+    
+    if (memory->opaque == NULL || memory->octants[0] == NULL)
+        g_error("Could not allocate FOV memory for a %d by %d window", m->width, m->height);
+    
+    for (int oct = 0; oct < 8; oct++) {
+        memory->octants[oct]  = memory->octants[0] + oct * size;
+        memory->examined[oct] = memory->octants[0] + (8 + oct) * size;
+    }
+    
+    c->fov_memory = memory;
+    return memory;
+}
+
+/*
+    Marks which octants have had any of the tiles they looked at change opacity since last time,
+    a 64x64 block of the window at a time. Column octants check against the block transposed.
+*/
+static void find_stale_octants(const struct FovMemory* memory, const FovScratch* s, 
+                               const FovMask* m, bool stale[8]) {
+    for (int oct = 0; oct < 8; oct++)
+        stale[oct] = !memory->valid;
+    
+    if (!memory->valid)
+        return;
+    
+    const int col_words = (m->height + 63) / 64;
+    guint64 block[64];
+    
+    for (int by = 0; by < col_words; by++) {
+        for (int bx = 0; bx < m->row_words; bx++) {
+            guint64 any = 0;
+            
+            for (int r = 0; r < 64; r++) {
+                const size_t word = (size_t)(by * 64 + r) * m->row_words + bx;
+                block[r] = (by * 64 + r < m->height) ? memory->opaque[word] ^ s->opaque[word] : 0;
+                any |= block[r];
+            }
+            
+            if (!any)
+                continue;
+            
+            for (int oct = 0; oct < 8; oct++) {
+                const guint64* examined = &memory->examined[oct][(size_t)by * 64 * m->row_words];
+                
+                if (OCTANTS[oct][1] != 0 || stale[oct])
+                    continue;
+                
+                for (int r = 0; r < 64 && by * 64 + r < m->height; r++)
+                    stale[oct] |= (block[r] & examined[(size_t)r * m->row_words + bx]) != 0;
+            }
+            
+            transpose64(block);
+            
+            int left = 0;
+            
+            for (int oct = 0; oct < 8; oct++) {
+                const guint64* examined = &memory->examined[oct][(size_t)bx * 64 * col_words];
+                
+                if (OCTANTS[oct][1] != 0 && !stale[oct]) {
+                    for (int r = 0; r < 64 && bx * 64 + r < m->width; r++)
+                        stale[oct] |= (block[r] & examined[(size_t)r * col_words + by]) != 0;
+                }
+                
+                left += !stale[oct];
+            }
+            
+            //Everything has to be done again anyway
+            if (left == 0)
+                return;
+        }
+    }
+}
+
+//Scans an octant for incremental FOV, keeping what it saw and looked at in memory.
+static void remember_octant(struct FovMemory* memory, FovScratch* s, const FovMask* m, int oct,
+                            int cx, int cy, int radius, int pieces, float slopes[2][2]) {
+    const size_t size = (OCTANTS[oct][1] == 0) ? (size_t)m->row_words * m->height
+                                               : (size_t)((m->height + 63) / 64) * m->width;
+    
+    memset(memory->octants[oct],  0, size * sizeof(guint64));
+    memset(memory->examined[oct], 0, size * sizeof(guint64));
+    
+    for (int p = 0; p < pieces; p++)
+        scan_octant(s, m, memory->octants[oct], memory->examined[oct], cx, cy, radius, 
+                    OCTANTS[oct], slopes[p][0], slopes[p][1]);
+    
+    memory->pieces[oct] = pieces;
+    memcpy(memory->slopes[oct], slopes, sizeof(memory->slopes[oct]));
+}
+
+//Puts the octants' results together into m.
+static void combine_octants(const struct FovMemory* memory, FovScratch* s, FovMask* m) {
+    const size_t row_size = (size_t)m->row_words * m->height;
+    const size_t col_size = (size_t)((m->height + 63) / 64) * m->width;
+    
+    memset(s->lit_t, 0, col_size * sizeof(guint64));
+    
+    for (int oct = 0; oct < 8; oct++) {
+        const guint64* seen = memory->octants[oct];
+        
+        if (OCTANTS[oct][1] == 0) {
+            for (size_t w = 0; w < row_size; w++)
+                m->bits[w] |= seen[w];
+        } else {
+            for (size_t w = 0; w < col_size; w++)
+                s->lit_t[w] |= seen[w];
+        }
+    }
+    
+    memset(s->blocks, true, (size_t)m->row_words * ((m->height + 63) / 64));
+    merge_column_blocks(s, m);
+}
+
+#endif
+
+/*
+    Shadowcasts from a creature into its visibility mask (which must already be positioned). 
+    Directional FOV only scans the octants the creature's cone reaches, and only the part of each
+    inside it. With incremental_fov, octants that can't have changed since last time aren't 
+    scanned again.
+*/
+static void shadowcast(Creature* c, FovMask* m, bool directional, FovScratch* s, 
+                       FovCacheStats* stats) {
+    Level* l = c->current_level;
+    
+    const int cx = c->x - m->x;
+    const int cy = c->y - m->y;
+    
+    int radius = c->radius;
+    
+    //No radius means as far as the window goes, as libtcod does it
+    if (radius == 0) {
+        const int max_x = MAX(m->width - cx, cx);
+        const int max_y = MAX(m->height - cy, cy);
+        radius = (int)sqrt(max_x * max_x + max_y * max_y) + 1;
+    }
+    
+    memset(m->bits, 0, (size_t)m->row_words * m->height * sizeof(guint64));
+    
+    if (directional && (c->direction < North || c->direction > Northwest))
+        g_error("Creature has invalid direction");
+    
+    const bool cone = directional && c->fov_half_width < 180.0f;
+    const float facing = c->direction * 45.0f;
+    
+#ifdef TSMI_SCALAR_FOV
+    (void)s;
+    
+    PROFILE_START(compute);
+    
+    for (int oct = 0; oct < 8; oct++) {
+        float slopes[2][2] = {{1.0f, 0.0f}};
+        const int pieces = cone ? cone_slopes(OCTANTS[oct], facing, c->fov_half_width, slopes) : 1;
+        
+        for (int p = 0; p < pieces; p++)
+            cast_light(l, m, cx, cy, 1, slopes[p][0], slopes[p][1], radius, radius * radius, 
+                       OCTANTS[oct]);
+    }
+    
+    stats->octants_cast += 8;
+#else
+    PROFILE_START(build);
+    prepare_scratch(s, l, m, radius);
+    PROFILE_STOP(PROFILE_FOV_BUILD, build);
+    
+    PROFILE_START(compute);
+    
+    struct FovMemory* memory = c->incremental_fov ? fov_memory_for(c, m, radius) : NULL;
+    bool stale[8] = {true, true, true, true, true, true, true, true};
+    
+    const bool moved = memory != NULL && 
+                       (!memory->placed || memory->x != m->x || memory->y != m->y);
+    
+    if (memory != NULL) {
+        memory->placed = true;
+        memory->x      = m->x;
+        memory->y      = m->y;
+        
+        //Backing off after steps that didn't pay, so scan the plain way and forget
+        if (moved && memory->skip > 0) {
+            memory->skip--;
+            memory->valid = false;
+            memory        = NULL;
+        }
+    }
+    
+    if (memory != NULL)
+        find_stale_octants(memory, s, m, stale);
+    
+    int reused = 0;
+    
+    for (int oct = 0; oct < 8; oct++) {
+        const bool along_rows = (OCTANTS[oct][1] == 0);
+        float slopes[2][2] = {{1.0f, 0.0f}};
+        const int pieces = cone ? cone_slopes(OCTANTS[oct], facing, c->fov_half_width, slopes) : 1;
+        
+        if (memory == NULL) {
+            for (int p = 0; p < pieces; p++)
+                scan_octant(s, m, along_rows ? m->bits : s->lit_t, NULL, cx, cy, radius, 
+                            OCTANTS[oct], slopes[p][0], slopes[p][1]);
+        } else if (!stale[oct] && pieces == memory->pieces[oct] && 
+                   memcmp(slopes, memory->slopes[oct], pieces * sizeof(slopes[0])) == 0) {
+            stats->octants_reused++;
+            reused += (pieces > 0);
+            continue;
+        } else {
+            remember_octant(memory, s, m, oct, cx, cy, radius, pieces, slopes);
+        }
+        
+        stats->octants_cast++;
+    }
+    
+    if (memory == NULL) {
+        merge_column_blocks(s, m);
+    } else {
+        combine_octants(memory, s, m);
+        memcpy(memory->opaque, s->opaque, (size_t)m->row_words * m->height * sizeof(guint64));
+        
+        //A step that kept less than a couple of octants didn't pay for the remembering - the 
+        //ground round here changes too much from tile to tile. Back off for longer each time it 
+        //happens in a row.
+        if (moved && memory->valid && reused < 2) {
+            memory->backoff = MIN(MAX(2 * memory->backoff, 1), FOV_MEMORY_MAX_BACKOFF);
+            memory->skip    = memory->backoff;
+        } else if (reused >= 2) {
+            memory->backoff = 0;
+        }
+        
+        memory->valid = true;
+    }
+#endif
+    
+    PROFILE_STOP(PROFILE_FOV_COMPUTE, compute);
+    
+    bitplane_put(m->bits, m->row_words, cx, cy, true);
+}
+
+//I THINK "degree" should be the input from the game counter.
+double day_night_cycle(long long degree) {
+    double rads = (degree * G_PI) / 180.0;
+    double time = 0.4 * cos(rads) + 0.6;    
+       
+    return time;      
+}
+
+static FovCacheStats fov_stats = {0, 0, 0, 0};
+
+FovCacheStats fov_cache_stats(void) {
+    return fov_stats;
+}
+
+void fov_reset_cache_stats(void) {
+    fov_stats = (FovCacheStats){0, 0, 0, 0};
+}
+
+/*
+    Whether a creature's visibility from last time is still right for a window at window_x, 
+    window_y. Changes to the level outside the window can't affect it, so they are let through.
+*/
+static bool fov_cache_valid_p(Creature* c, int window_x, int window_y, bool directional) {
+    Level* l = c->current_level;
+    
+    if (!c->fov_cached || c->fov_level_id != l->id || c->fov_x != window_x || c->fov_y != window_y ||
+        c->fov_cached_radius != c->radius || c->fov_cached_directional != directional ||
+        (directional && (c->fov_cached_direction  != c->direction || 
+                         c->fov_cached_half_width != c->fov_half_width)))
+        return false;
+    
+    if ((l->epoch - c->fov_epoch) > LEVEL_JOURNAL_SIZE)
+        return false;
+    
+    for (guint64 change = c->fov_epoch; change < l->epoch; change++) {
+        const Coord tile = l->journal[change % LEVEL_JOURNAL_SIZE];
+        
+        if (tile.x >= window_x && tile.x < window_x + c->visibility.width &&
+            tile.y >= window_y && tile.y < window_y + c->visibility.height)
+            return false;
+    }
+    
+    c->fov_epoch = l->epoch;
+    return true;
+}
+
+//Makes a mask width by height, keeping its old bits array if it's already that size.
+static void resize_fov_mask(FovMask* m, int width, int height) {
+    if (m->width == width && m->height == height)
+        return;
+    
+    free(m->bits);
+    
+    m->width     = width;
+    m->height    = height;
+    m->row_words = (width + 63) / 64;
+    m->bits      = calloc((size_t)m->row_words * height, sizeof(guint64));
+    
+    if (m->bits == NULL)
+        g_error("Could not allocate a %d by %d FOV mask", width, height);
+}
+
+//compute_fov, with the scratch space and stats to use given - so it can be run on any thread
+static const FovMask* update_fov(Creature* c, bool directional, FovScratch* s, 
+                                 FovCacheStats* stats) {
+    //Just big enough for the creature's radius, with the creature in the middle. No radius means
+    //no limit, so that gets a screen sized window.
+    const int width  = (c->radius > 0) ? 2 * c->radius + 1 : SCREEN_W;
+    const int height = (c->radius > 0) ? 2 * c->radius + 1 : SCREEN_H;
+    
+    const int window_x = c->x - width / 2;
+    const int window_y = c->y - height / 2;
+    
+    if (fov_cache_valid_p(c, window_x, window_y, directional)) {
+        stats->hits++;
+        return &c->visibility;
+    }
+    
+    stats->misses++;
+    
+    FovMask* m = &c->visibility;
+    resize_fov_mask(m, width, height);
+    m->x = window_x;
+    m->y = window_y;
+    
+    TRACE_START(fov);
+    shadowcast(c, m, directional, s, stats);
+    TRACE_STOP(fov, "fov");
+    m->version++;
+    
+    c->fov_cached             = true;
+    c->fov_level_id           = c->current_level->id;
+    c->fov_x                  = window_x;
+    c->fov_y                  = window_y;
+    c->fov_epoch              = c->current_level->epoch;
+    c->fov_cached_directional = directional;
+    c->fov_cached_direction   = c->direction;
+    c->fov_cached_radius      = c->radius;
+    c->fov_cached_half_width  = c->fov_half_width;
+    
+    return m;
+}
+
+const FovMask* compute_fov(Creature* c, bool directional) {
+    return update_fov(c, directional, &fov_scratch, &fov_stats);
+}
+
+/*
+    The FOV worker pool, started the first time compute_fov_batch is called. Each batch, start 
+    gets posted once for every worker; workers (and the calling thread) then take creatures off
+    the batch one at a time under lock until there are none left, and post done. Any one worker
+    might get through two start posts in a batch if it's quick, but either way the caller has 
+    all of them back (and so all of the creatures done) once done has been posted workers times.
+*/
+static struct {
+    int workers;
+    TCOD_thread_t* threads;
+    TCOD_semaphore_t start;
+    TCOD_semaphore_t done;
+    TCOD_mutex_t lock;
+    
+    //One each for the workers, and the calling thread's at the end
+    FovScratch* scratch;
+    FovCacheStats* stats;
+    
+    //The batch being worked through
+    Creature** creatures;
+    int count;
+    int next;
+    bool directional;
+    bool quit;
+}fov_pool = {0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, false, false};
+
+static void run_fov_batch(int id) {
+    while (true) {
+        TCOD_mutex_in(fov_pool.lock);
+        const int i = fov_pool.next++;
+        TCOD_mutex_out(fov_pool.lock);
+        
+        if (i >= fov_pool.count)
+            return;
+        
+        update_fov(fov_pool.creatures[i], fov_pool.directional, &fov_pool.scratch[id], 
+                   &fov_pool.stats[id]);
+    }
+}
+
+static int fov_worker(void* data) {
+    const int id = (int)(intptr_t)data;
+    
+    TRACE_THREAD("fov worker");
+    
+    while (true) {
+        TCOD_semaphore_lock(fov_pool.start);
+        
+        if (fov_pool.quit) {
+            TRACE_EXIT();
+            return 0;
+        }
+        
+        run_fov_batch(id);
+        TCOD_semaphore_unlock(fov_pool.done);
+    }
+}
+
+static void start_fov_workers(void) {
+    fov_pool.workers = MAX(0, TCOD_sys_get_num_cores() - 1);
+    fov_pool.start   = TCOD_semaphore_new(0);
+    fov_pool.done    = TCOD_semaphore_new(0);
+    fov_pool.lock    = TCOD_mutex_new();
+    fov_pool.quit    = false;
+    
+    fov_pool.threads = malloc(fov_pool.workers * sizeof(TCOD_thread_t));
+    fov_pool.scratch = calloc(fov_pool.workers + 1, sizeof(FovScratch));
+    fov_pool.stats   = calloc(fov_pool.workers + 1, sizeof(FovCacheStats));
+    
+    if ((fov_pool.workers > 0 && fov_pool.threads == NULL) || fov_pool.scratch == NULL || 
+        fov_pool.stats == NULL)
+        g_error("Could not allocate the FOV worker pool");
+    
+    //The calling thread's scratch space is the one compute_fov uses anyway
+    fov_pool.scratch[fov_pool.workers] = fov_scratch;
+    
+    for (int i = 0; i < fov_pool.workers; i++)
+        fov_pool.threads[i] = TCOD_thread_new(fov_worker, (void*)(intptr_t)i);
+}
+
+static void free_scratch(FovScratch* s) {
+    free(s->opaque);
+    free(s->opaque_t);
+    free(s->lit_t);
+    free(s->blocks);
+    free(s->reach);
+    free(s->rows[0]);
+    free(s->rows[1]);
+}
+
+void compute_fov_batch(Creature** creatures, int count, bool directional) {
+    if (fov_pool.lock == NULL)
+        start_fov_workers();
+    
+    TRACE_START(batch);
+    
+    fov_pool.creatures   = creatures;
+    fov_pool.count       = count;
+    fov_pool.next        = 0;
+    fov_pool.directional = directional;
+    
+    const int id = fov_pool.workers;
+    fov_pool.scratch[id] = fov_scratch;
+    
+    //Not worth waking anyone for just one or two
+    const int helpers = MIN(fov_pool.workers, count - 1);
+    
+    for (int i = 0; i < helpers; i++)
+        TCOD_semaphore_unlock(fov_pool.start);
+    
+    run_fov_batch(id);
+    
+    for (int i = 0; i < helpers; i++)
+        TCOD_semaphore_lock(fov_pool.done);
+    
+    //Whatever the calling thread grew its scratch space to, compute_fov can have
+    fov_scratch = fov_pool.scratch[id];
+    
+    for (int i = 0; i <= fov_pool.workers; i++) {
+        fov_stats.hits           += fov_pool.stats[i].hits;
+        fov_stats.misses         += fov_pool.stats[i].misses;
+        fov_stats.octants_cast   += fov_pool.stats[i].octants_cast;
+        fov_stats.octants_reused += fov_pool.stats[i].octants_reused;
+        fov_pool.stats[i] = (FovCacheStats){0, 0, 0, 0};
+    }
+    
+    TRACE_STOP(batch, "fov_batch");
+}
+
+void stop_fov_workers(void) {
+    if (fov_pool.lock == NULL)
+        return;
+    
+    fov_pool.quit = true;
+    
+    for (int i = 0; i < fov_pool.workers; i++)
+        TCOD_semaphore_unlock(fov_pool.start);
+    
+    for (int i = 0; i < fov_pool.workers; i++) {
+        TCOD_thread_wait(fov_pool.threads[i]);
+        TCOD_thread_delete(fov_pool.threads[i]);
+        free_scratch(&fov_pool.scratch[i]);
+    }
+    
+    TCOD_semaphore_delete(fov_pool.start);
+    TCOD_semaphore_delete(fov_pool.done);
+    TCOD_mutex_delete(fov_pool.lock);
+    
+    free(fov_pool.threads);
+    free(fov_pool.scratch);
+    free(fov_pool.stats);
+    
+    fov_pool.workers = 0;
+    fov_pool.threads = NULL;
+    fov_pool.scratch = NULL;
+    fov_pool.stats   = NULL;
+    fov_pool.lock    = NULL;
+}
+
+/*
+    The colour of every (palette entry, shade, visible) combination for the time of day being 
+    drawn, so render is a table lookup per tile rather than two colour lerps. Shades are bucketed 
+    into TSMI_SHADE_LEVELS; entry k stands for the shade k * 255 / (TSMI_SHADE_LEVELS - 1), so the
+    ends of a seed's min..max range still come out exactly.
+    
+    Laid out as colours[(seed * 2 + visible) * TSMI_SHADE_LEVELS + level], with one black entry
+    on the end for tiles fog of war hides.
+*/
+typedef struct {
+    //What the table was built for - NULL if it's out of date
+    const Level* level;
+    int          palette_size;
+    float        time;
+    
+    TCOD_color_t* colours;
+    int           capacity;
+    //Index of the black entry
+    int           black;
+}ShadeTable;
+
+static ShadeTable shade_table = {NULL, 0, 0.0f, NULL, 0, 0};
+
+//The nearest of the entries to a shade, so it's never more than half a bucket out
+static inline int shade_entry(guint16 seed, int visible, guint8 shade) {
+    const int level = (shade * (TSMI_SHADE_LEVELS - 1) + 127) / 255;
+    
+    return (seed * 2 + visible) * TSMI_SHADE_LEVELS + level;
+}
+
+//Only redone when the level, its palette or the time of day change, which is rarely every frame.
+static void update_shade_table(ShadeTable* t, const Level* l, const TileSeed** palette, 
+                               int palette_size, float time) {
+    
+    if (t->level == l && t->palette_size == palette_size && t->time == time)
+        return;
+    
+    const int size = palette_size * 2 * TSMI_SHADE_LEVELS + 1;
+    
+    if (size > t->capacity) {
+        TCOD_color_t* colours = realloc(t->colours, size * sizeof(TCOD_color_t));
+        
+        if (colours == NULL)
+            g_error("realloc returned null when trying to grow the shade table");
+        
+        t->colours  = colours;
+        t->capacity = size;
+    }
+    
+    for (int seed = 0; seed < palette_size; seed++) {
+        const TileSeed* tc = palette[seed];
+        TCOD_color_t* plain   = &t->colours[(seed * 2)     * TSMI_SHADE_LEVELS];
+        TCOD_color_t* visible = &t->colours[(seed * 2 + 1) * TSMI_SHADE_LEVELS];
+        
+        for (int k = 0; k < TSMI_SHADE_LEVELS; k++) {
+            const guint8 shade = k * 255 / (TSMI_SHADE_LEVELS - 1);
+            
+            plain[k]   = TCOD_color_lerp(tc->night,     day_colour(tc, shade, false), time);
+            visible[k] = TCOD_color_lerp(tc->night_vis, day_colour(tc, shade, true),  time);
+        }
+    }
+    
+    t->black = size - 1;
+    t->colours[t->black] = TCOD_black;
+    
+    t->level        = l;
+    t->palette_size = palette_size;
+    t->time         = time;
+}
+
+//TODO: a list of creatures (ie the monsters on screen).
+void render(Level* l, Coord* camera, Creature * pc, float time, bool fog_of_war, bool directional) {      
+    TRACE_START(render);
+    render_with_fov(l, camera, pc, compute_fov(pc, directional), time, fog_of_war);
+    TRACE_STOP(render, "render");
+}
+
+/*
+    A frame is made in two steps. First take_snapshot copies what it needs from the level - the 
+    cells under the screen, which of them are in view or remembered - and updates the visible and
+    seen bitplanes. Then draw_frame works out the colours and puts them on the console. render 
+    does both in one go; render_begin hands the second step to a render thread, so the level can be
+    changed again while the frame is drawn.
+    
+    draw_frame keeps what it last put on the console, so the next frame only has to put the cells
+    that changed. Frames are drawn into `back`, then compared with `front` - which is what 
+    render_buffer hands out, and all there is when headless. `back` is kept between frames too: 
+    if the camera has only moved a little, it's slid over and only the strip that has come into 
+    view (and cells going in or out of the PC's view) are worked out again.
+*/
+//Everything a frame is drawn from
+typedef struct {
+    const Level*   level;
+    guint64        revision;
+    Coord          camera;
+    const FovMask* fov;
+    guint64        fov_id;
+    guint64        fov_version;
+    float          time;
+    bool           fog_of_war;
+    int            pc_x;
+    int            pc_y;
+    char           pc_sym;
+    TCOD_color_t   pc_fg;
+    TCOD_color_t   pc_bg;
+}FrameInputs;
+
+//What take_snapshot copies out of the level. Rows of bits are screen rows, `words` long.
+typedef struct {
+    FrameInputs inputs;
+    
+    int width;
+    int height;
+    int words;
+    
+    //Screen cells that are on the level, in the PC's view, and not hidden by fog of war
+    guint64* on;
+    guint64* view;
+    guint64* shown;
+    //The level's cells under the screen (only the ones on the level mean anything)
+    Cell* cells;
+    
+    //The level's palette - set_tile can grow the real one while the frame is drawn
+    const TileSeed** palette;
+    int palette_size;
+    int palette_capacity;
+}FrameSnapshot;
+
+static FrameSnapshot snapshot;
+
+static struct {
+    ScreenCell* front;
+    ScreenCell* back;
+    int         width;
+    int         height;
+    //False if the console can't be trusted to still hold front
+    bool        front_valid;
+    //False until back holds a whole frame, drawn from `last`
+    bool        back_valid;
+    
+    //Which screen cells were in the PC's view in the last frame (view[0]) and this one (view[1]),
+    //one row of bits per screen row
+    guint64*    view[2];
+    int         view_words;
+    
+    FrameInputs last;
+}screen;
+
+//For render_begin
+static struct {
+    TCOD_thread_t    thread;
+    TCOD_semaphore_t start;
+    TCOD_semaphore_t done;
+    //A frame has been handed over and render_end hasn't waited for it yet
+    bool             busy;
+    bool             quit;
+}render_thread = {NULL, NULL, NULL, false, false};
+
+static RenderStats render_counters = {0, 0, 0, 0, 0};
+
+RenderStats render_stats(void) {
+    render_end();
+    return render_counters;
+}
+
+void render_reset_stats(void) {
+    render_end();
+    render_counters = (RenderStats){0, 0, 0, 0, 0};
+}
+
+void render_invalidate(void) {
+    render_end();
+    screen.front_valid = false;
+}
+
+const ScreenCell* render_buffer(void) {
+    render_end();
+    return screen.front_valid ? screen.front : NULL;
+}
+
+static inline bool same_colour_p(TCOD_color_t a, TCOD_color_t b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+static inline bool same_screen_cell_p(const ScreenCell* a, const ScreenCell* b) {
+    guint64 x, y;
+    
+    G_STATIC_ASSERT(sizeof(ScreenCell) == sizeof(guint64));
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    
+    return x == y;
+}
+
+//Bits lo to hi - 1 of a word (none if hi <= lo), clipped to the word
+static inline guint64 bit_range(int lo, int hi) {
+    lo = MAX(lo, 0);
+    hi = MIN(hi, 64);
+    
+    if (hi <= lo)
+        return 0;
+    
+    const guint64 below_hi = (hi == 64) ? ~G_GUINT64_CONSTANT(0) 
+                                        : (G_GUINT64_CONSTANT(1) << hi) - 1;
+    
+    return below_hi & ~((G_GUINT64_CONSTANT(1) << lo) - 1);
+}
+
+static void resize_screen(int width, int height) {
+    if (screen.width == width && screen.height == height)
+        return;
+    
+    const size_t size = (size_t)width * height * sizeof(ScreenCell);
+    ScreenCell* front = realloc(screen.front, size);
+    ScreenCell* back  = realloc(screen.back,  size);
+    
+    screen.view_words = (width + 63) / 64;
+    guint64* view_0 = realloc(screen.view[0], (size_t)screen.view_words * height * sizeof(guint64));
+    guint64* view_1 = realloc(screen.view[1], (size_t)screen.view_words * height * sizeof(guint64));
+    
+    if (front == NULL || back == NULL || view_0 == NULL || view_1 == NULL)
+        g_error("realloc returned null when trying to allocate the screen buffers");
+    
+    screen.front       = front;
+    screen.back        = back;
+    screen.view[0]     = view_0;
+    screen.view[1]     = view_1;
+    screen.width       = width;
+    screen.height      = height;
+    screen.front_valid = false;
+    screen.back_valid  = false;
+}
+
+static void resize_snapshot(FrameSnapshot* s, int width, int height, int palette_size) {
+    if (s->width != width || s->height != height) {
+        s->width  = width;
+        s->height = height;
+        s->words  = (width + 63) / 64;
+        
+        const size_t words = (size_t)s->words * height * sizeof(guint64);
+        
+        s->on    = realloc(s->on,    words);
+        s->view  = realloc(s->view,  words);
+        s->shown = realloc(s->shown, words);
+        s->cells = realloc(s->cells, (size_t)width * height * sizeof(Cell));
+        
+        if (s->on == NULL || s->view == NULL || s->shown == NULL || s->cells == NULL)
+            g_error("realloc returned null when trying to allocate a frame snapshot");
+    }
+    
+    if (palette_size > s->palette_capacity) {
+        s->palette = realloc(s->palette, palette_size * sizeof(TileSeed*));
+        
+        if (s->palette == NULL)
+            g_error("realloc returned null when trying to allocate a frame snapshot");
+        
+        s->palette_capacity = palette_size;
+    }
+}
+
+static bool same_inputs_p(const FrameInputs* a, const FrameInputs* b) {
+    return a->level == b->level && a->revision == b->revision && 
+           a->camera.x == b->camera.x && a->camera.y == b->camera.y && 
+           a->fov == b->fov && a->fov_id == b->fov_id && a->fov_version == b->fov_version && 
+           a->time == b->time && a->fog_of_war == b->fog_of_war && 
+           a->pc_x == b->pc_x && a->pc_y == b->pc_y && a->pc_sym == b->pc_sym && 
+           same_colour_p(a->pc_fg, b->pc_fg) && same_colour_p(a->pc_bg, b->pc_bg);
+}
+
+//True if the level looks just as it did last frame, and enough of the last frame is still on 
+//screen to be worth sliding over.
+static bool scrollable_p(const FrameInputs* last, const FrameInputs* now) {
+    return last->level == now->level && last->revision == now->revision && 
+           last->time == now->time && last->fog_of_war == now->fog_of_war && 
+           abs(now->camera.x - last->camera.x) < screen.width / 2 && 
+           abs(now->camera.y - last->camera.y) < screen.height / 2;
+}
+
+//Copies cells x .. x + count - 1 of row y (all on the level) to out, a chunk at a time.
+static void copy_cells(Level* l, int x, int y, int count, Cell* out) {
+    if (l->storage == LEVEL_FLAT) {
+        memcpy(out, &l->cells[x + y * l->stride], count * sizeof(Cell));
+        return;
+    }
+    
+    while (count > 0) {
+        const int run   = MIN(count, CHUNK_SIZE - (x & (CHUNK_SIZE - 1)));
+        const int index = (x >> CHUNK_SHIFT) + (y >> CHUNK_SHIFT) * l->chunks_w;
+        const Chunk* chunk = (l->storage == LEVEL_PAGED) ? level_paged_chunk(l, index, false) 
+                                                         : l->chunks[index];
+        
+        //A missing chunk is all null tiles, and NULL_CELL is all 0
+        if (chunk == NULL)
+            memset(out, 0, run * sizeof(Cell));
+        else
+            memcpy(out, &chunk->cells[(x & (CHUNK_SIZE - 1)) + (y & (CHUNK_SIZE - 1)) * CHUNK_SIZE],
+                   run * sizeof(Cell));
+        
+        x     += run;
+        out   += run;
+        count -= run;
+    }
+}
+
+/*
+    First half of a frame, on the game's thread: copies what draw_frame needs into s, and updates 
+    the visible and seen bits of the tiles on screen a word at a time. @return False if the frame
+    would come out exactly as the last one did, so there's nothing to draw.
+    
+    Mustn't be called while the render thread is drawing - it looks at what was drawn last.
+*/
+static bool take_snapshot(FrameSnapshot* s, Level* l, Coord* camera, Creature* pc, 
+                          const FovMask* fov, float time, bool fog_of_war) {
+    
+    const FrameInputs now = {l, l->revision, *camera, fov, fov->id, fov->version, time, 
+                             fog_of_war, pc->x, pc->y, pc->sym, pc->fg, pc->bg};
+    
+    render_counters.frames++;
+    
+    //Nothing that goes into the picture has changed, so the console already shows it
+    if (screen.back_valid && screen.front_valid && screen.width == SCREEN_W && 
+        screen.height == SCREEN_H && same_inputs_p(&screen.last, &now)) {
+        
+        render_counters.idle_frames++;
+        render_counters.last_cells_touched = 0;
+        return false;
+    }
+    
+    PROFILE_START(snapshot);
+    TRACE_START(snapshot);
+    
+    resize_snapshot(s, SCREEN_W, SCREEN_H, l->palette_size);
+    
+    s->inputs = now;
+    s->palette_size = l->palette_size;
+    memcpy(s->palette, l->palette, l->palette_size * sizeof(TileSeed*));
+    
+    //The part of each screen row that's on the level
+    const int first = MAX(camera->x, 0);
+    const int last  = MIN(camera->x + SCREEN_W, l->width);
+    
+    for (int sy = 0; sy < SCREEN_H; sy++) {
+        const int j = camera->y + sy;
+        const bool on_level = j >= 0 && j < l->height;
+        
+        const guint64* fov_row = (on_level && (unsigned)(j - fov->y) < (unsigned)fov->height) ?
+                                 &fov->bits[(size_t)(j - fov->y) * fov->row_words] : NULL;
+        guint64* visible_row = on_level ? &l->visible[(size_t)j * l->row_words] : NULL;
+        guint64* seen_row    = on_level ? &l->seen[(size_t)j * l->row_words]    : NULL;
+        
+        //64 screen cells at a time
+        for (int sx = 0; sx < SCREEN_W; sx += 64) {
+            const int count = MIN(64, SCREEN_W - sx);
+            const int x = camera->x + sx;
+            const int word = sy * s->words + sx / 64;
+            
+            //Which of them are on the level, and in view
+            const int lo = CLAMP(first - x, 0, count);
+            const int hi = CLAMP(last  - x, 0, count);
+            const guint64 on = on_level ? bit_range(lo, hi) : 0;
+            
+            const guint64 in_view = (fov_row != NULL) ? 
+                                    bitplane_bits(fov_row, fov->row_words, x - fov->x) & on : 0;
+            
+            s->on[word]    = on;
+            s->view[word]  = in_view;
+            s->shown[word] = 0;
+            
+            if (on == 0)
+                continue;
+            
+            const guint64 span = on >> lo;
+            const guint64 seen = bitplane_bits(seen_row, l->row_words, x + lo) | (in_view >> lo);
+            
+            put_bits(visible_row, l->row_words, x + lo, in_view >> lo, span);
+            put_bits(seen_row,    l->row_words, x + lo, seen,          span);
+            
+            s->shown[word] = fog_of_war ? (seen & span) << lo : on;
+            
+            copy_cells(l, x + lo, j, hi - lo, &s->cells[sy * SCREEN_W + sx + lo]);
+        }
+    }
+    
+    TRACE_STOP(snapshot, "snapshot");
+    PROFILE_STOP(PROFILE_SNAPSHOT, snapshot);
+    
+    return true;
+}
+
+//Moves the back buffer so the cell at dx, dy ends up at 0, 0. What's uncovered is left as it was.
+static void scroll_screen(int dx, int dy) {
+    if (dx == 0 && dy == 0)
+        return;
+    
+    const int width  = screen.width - abs(dx);
+    const int from_x = MAX(dx, 0);
+    const int to_x   = MAX(-dx, 0);
+    
+    //Rows are copied in the order that never overwrites one still to be copied
+    const int first = (dy >= 0) ? 0 : screen.height - 1;
+    const int end   = (dy >= 0) ? screen.height - dy : -dy - 1;
+    const int step  = (dy >= 0) ? 1 : -1;
+    
+    for (int y = first; y != end; y += step)
+        memmove(&screen.back[y * screen.width + to_x], 
+                &screen.back[(y + dy) * screen.width + from_x], width * sizeof(ScreenCell));
+}
+
+//Puts the cells of the back buffer that differ from the front one on the console (or just in the
+//front buffer, if headless).
+//
+//Rather than a TCOD_console_put_char_ex per cell, the root console's cells are written directly,
+//the way put_char_ex would. Characters libtcod's font can't show are skipped, same as put_char_ex.
+static void present_screen(void) {
+    TCOD_console_data_t* root = headless ? NULL : (TCOD_console_data_t*)TCOD_root;
+    
+    //Only the part of the screen that fits on the console
+    const int width  = (root != NULL) ? MIN(screen.width,  root->w) : 0;
+    const int height = (root != NULL) ? MIN(screen.height, root->h) : 0;
+    
+    int touched = 0;
+    
+    for (int y = 0; y < screen.height; y++) {
+        const ScreenCell* back  = &screen.back[y * screen.width];
+        ScreenCell*       front = &screen.front[y * screen.width];
+        char_t*           out   = (y < height) ? &root->buf[y * root->w] : NULL;
+        
+        for (int x = 0; x < screen.width; x++) {
+            if (screen.front_valid && same_screen_cell_p(&back[x], &front[x]))
+                continue;
+            
+            const int c = back[x].sym;
+            
+            if (out != NULL && x < width && c >= 0 && c < TCOD_max_font_chars) {
+                out[x].c    = c;
+                out[x].cf   = ascii_to_tcod[c];
+                out[x].fore = back[x].fore;
+                out[x].back = back[x].back;
+            }
+            
+            front[x] = back[x];
+            touched++;
+        }
+    }
+    
+    screen.front_valid = true;
+    
+    render_counters.cells_touched      += touched;
+    render_counters.last_cells_touched  = touched;
+}
+
+/*
+    Second half of a frame: works out the colour of each screen cell from a snapshot and puts the 
+    ones that changed on the console. Doesn't look at the level at all, so it can run on the 
+    render thread. Which of the three colours each tile gets - visible, remembered or black - is 
+    picked with bit masks, not a branch per tile.
+*/
+static void draw_frame(const FrameSnapshot* s) {
+    const FrameInputs* now = &s->inputs;
+    const FrameInputs last = screen.last;
+    
+    PROFILE_START(shade);
+    TRACE_START(draw);
+    
+    resize_screen(s->width, s->height);
+    
+    const bool had_frame = screen.back_valid;
+    screen.last = *now;
+    
+    update_shade_table(&shade_table, now->level, s->palette, s->palette_size, now->time);
+    
+    //Slide the last frame over if we can, and only work out the cells it doesn't cover, plus any 
+    //going in or out of view - and the cell the PC was drawn over.
+    const bool scroll = had_frame && scrollable_p(&last, now);
+    const int dx = scroll ? now->camera.x - last.camera.x : 0;
+    const int dy = scroll ? now->camera.y - last.camera.y : 0;
+    const int old_pc_x = last.pc_x - now->camera.x;
+    const int old_pc_y = last.pc_y - now->camera.y;
+    
+    if (scroll)
+        scroll_screen(dx, dy);
+    
+    const ScreenCell null_cell = {NULL_TILE_COMMON.sym, TCOD_black, TCOD_black, 0};
+    int drawn = 0;
+    
+    for (int sy = 0; sy < s->height; sy++) {
+        const guint64* old_view = (scroll && sy + dy >= 0 && sy + dy < s->height) ? 
+                                  &screen.view[0][(sy + dy) * screen.view_words] : NULL;
+        guint64* new_view = &screen.view[1][sy * screen.view_words];
+        ScreenCell* out = &screen.back[sy * s->width];
+        const Cell* cells = &s->cells[sy * s->width];
+        
+        for (int sx = 0; sx < s->width; sx += 64) {
+            const int count = MIN(64, s->width - sx);
+            const int word  = sy * s->words + sx / 64;
+            
+            const guint64 on      = s->on[word];
+            const guint64 in_view = s->view[word];
+            const guint64 shown   = s->shown[word];
+            
+            guint64 dirty = bit_range(0, count);
             
-            case Southeast:
-                start_x = MID_X; 
-                end_x   = SCREEN_W;
-                start_y = MID_Y;
-                end_y   = SCREEN_H;
-                break;
+            if (old_view != NULL) {
+                //Cells that were on screen last frame, and which of those were in view
+                const guint64 kept = bit_range(-dx - sx, s->width - dx - sx);
+                const guint64 was  = bitplane_bits(old_view, screen.view_words, sx + dx);
                 
-            case South:
-                start_x = 0; 
-                end_x   = SCREEN_W;
-                start_y = MID_Y + 1;
-                end_y   = SCREEN_H;
-                break;
+                dirty &= ~kept | (in_view ^ was);
                 
-            case Southwest:
-                start_x = 0; 
-                end_x   = MID_X + 1;
-                start_y = MID_Y;
-                end_y   = SCREEN_H;
-                break;
+                if (sy == old_pc_y && old_pc_x >= sx && old_pc_x < sx + count)
+                    dirty |= G_GUINT64_CONSTANT(1) << (old_pc_x - sx);
+            }
+            
+            new_view[sx / 64] = in_view;
+            
+            //Anything past the edge of the level is drawn as the (black) null tile
+            for (guint64 off = dirty & ~on; off != 0; off &= off - 1) {
+                out[sx + lowest_bit(off)] = null_cell;
+                drawn++;
+            }
+            
+            for (guint64 tiles = dirty & on; tiles != 0; tiles &= tiles - 1) {
+                const int k = lowest_bit(tiles);
+                const Cell* cell = &cells[sx + k];
+                const int visible = (in_view >> k) & 1;
+                //All ones if the tile is drawn at all, else all zeros
+                const int shows = -(int)((shown >> k) & 1);
                 
-            case West:
-                start_x = 0; 
-                end_x   = MID_X;
-                start_y = 0;
-                end_y   = SCREEN_H;
-                break;
+                const int entry = shade_entry(cell->seed, visible, cell->shade);
+                const int index = (entry & shows) | (shade_table.black & ~shows);
                 
-            case Northwest:
-                start_x = 0; 
-                end_x   = MID_X + 1;
-                start_y = 0;
-                end_y   = MID_Y + 1;
-                break;
-            
-            default:
-                g_error("Creature has invalid direction");
-                break;
+                out[sx + k] = (ScreenCell){s->palette[cell->seed]->sym, 
+                                           shade_table.colours[index], TCOD_black, 0};
+                drawn++;
+            }
         }
-    } else {
-        start_x = 0;
-        end_x = SCREEN_W;
-        start_y = 0;
-        end_y = SCREEN_H;
     }
     
-    TCOD_map_clear(c->fov);
+    guint64* swap  = screen.view[0];
+    screen.view[0] = screen.view[1];
+    screen.view[1] = swap;
     
-    for (int y = start_y; y < end_y; y++) {
-        for (int x = start_x; x < end_x; x++) {                       
-            Tile t = get_tile(c->current_level, (x + camera_x), (y + camera_y));
-            TCOD_map_set_properties(c->fov, x, y, !t.opaque, !t.solid);
+    const int pc_x = now->pc_x - now->camera.x;
+    const int pc_y = now->pc_y - now->camera.y;
+    
+    if (pc_x >= 0 && pc_x < s->width && pc_y >= 0 && pc_y < s->height)
+        screen.back[pc_y * s->width + pc_x] = (ScreenCell){now->pc_sym, now->pc_fg, now->pc_bg, 0};
+    
+    screen.back_valid = true;
+    render_counters.cells_drawn += drawn;
+    
+    PROFILE_STOP(PROFILE_SHADE, shade);
+    
+    PROFILE_START(write);
+    present_screen();
+    PROFILE_STOP(PROFILE_CONSOLE_WRITE, write);
+    
+    TRACE_STOP(draw, "draw_frame");
+}
+
+void render_with_fov(Level* l, Coord* camera, Creature* pc, const FovMask* fov, float time, 
+                     bool fog_of_war) {
+    
+    assert(0.0f <= time && time <= 1.0f);
+    
+    //A frame from render_begin has to be finished first
+    render_end();
+    
+    if (take_snapshot(&snapshot, l, camera, pc, fov, time, fog_of_war))
+        draw_frame(&snapshot);
+}
+
+static int render_thread_main(void* data) {
+    (void)data;
+    
+    TRACE_THREAD("render");
+    
+    while (true) {
+        TCOD_semaphore_lock(render_thread.start);
+        
+        if (render_thread.quit) {
+            TRACE_EXIT();
+            return 0;
         }
+        
+        draw_frame(&snapshot);
+        TCOD_semaphore_unlock(render_thread.done);
     }
-    
-    TCOD_map_compute_fov(c->fov, (SCREEN_W / 2), (SCREEN_H / 2), c->radius, true, FOV_SHADOW);
 }
 
-//I THINK "degree" should be the input from the game counter.
-double day_night_cycle(long long degree) {
-    double rads = (degree * G_PI) / 180.0;
-    double time = 0.4 * cos(rads) + 0.6;    
-       
-    return time;      
+void render_begin(Level* l, Coord* camera, Creature* pc, const FovMask* fov, float time, 
+                  bool fog_of_war) {
+    
+    assert(0.0f <= time && time <= 1.0f);
+    
+    render_end();
+    
+    if (!take_snapshot(&snapshot, l, camera, pc, fov, time, fog_of_war))
+        return;
+    
+    if (render_thread.thread == NULL) {
+        render_thread.start  = TCOD_semaphore_new(0);
+        render_thread.done   = TCOD_semaphore_new(0);
+        render_thread.quit   = false;
+        render_thread.thread = TCOD_thread_new(render_thread_main, NULL);
+    }
+    
+    render_thread.busy = true;
+    TCOD_semaphore_unlock(render_thread.start);
 }
 
-//TODO: a list of creatures (ie the monsters on screen).
-//TODO: Separate FOV from rendering here.
-void render(Level* l, Coord* camera, Creature * pc, float time, bool fog_of_war, bool directional) {      
+void render_end(void) {
+    if (!render_thread.busy)
+        return;
     
-    assert(0.0 <= time <= 1.0);
+    //Time spent waiting on the render thread
+    TRACE_START(wait);
+    TCOD_semaphore_lock(render_thread.done);
+    TRACE_STOP(wait, "render_end");
     
-    //Processing (mutating) fov before deciding what to render
-    process_fov(pc, camera->x, camera->y, directional);
+    render_thread.busy = false;
+}
+
+void flush_frame(void) {
+    render_end();
     
-    for (int j = camera->y; j < (camera->y + SCREEN_H); j++) {
-        for (int i = camera->x; i < (camera->x + SCREEN_W); i++) {
-            
-            Tile* t = &l->tiles[i + j * l->width];
-            TCOD_color_t colour;
-            
-            if (!TCOD_map_is_in_fov(pc->fov, (i - camera->x), (j - camera->y))) {
-                if ((!fog_of_war) || (t->seen)) {
-                    colour = TCOD_color_lerp(*t->night, t->day, time);
-                } else {
-                    colour = TCOD_black;
-                }
-                
-            } else {
-                colour = TCOD_color_lerp(*t->night_vis, t->day_vis, time);
-                t->seen = true;
-            }
+    if (headless)
+        return;
+    
+    PROFILE_START(flush);
+    TRACE_START(flush);
+    TCOD_console_flush();
+    TRACE_STOP(flush, "flush");
+    PROFILE_STOP(PROFILE_FLUSH, flush);
+}
 
-            TCOD_console_put_char_ex(0, i - camera->x, j - camera->y, t->sym, colour, TCOD_black); 
-        }       
-    }
-    TCOD_console_put_char_ex(0, SCREEN_W/2, SCREEN_H/2, pc->sym, pc->fg, pc->bg); 
+void stop_render_thread(void) {
+    render_end();
+    
+    if (render_thread.thread == NULL)
+        return;
+    
+    render_thread.quit = true;
+    TCOD_semaphore_unlock(render_thread.start);
+    TCOD_thread_wait(render_thread.thread);
+    TCOD_thread_delete(render_thread.thread);
+    
+    TCOD_semaphore_delete(render_thread.start);
+    TCOD_semaphore_delete(render_thread.done);
+    
+    render_thread.thread = NULL;
+    render_thread.start  = NULL;
+    render_thread.done   = NULL;
 }
 
 TCOD_map_t new_fov_map() {
@@ -318,10 +2370,35 @@ const TileSeed NULL_TILE_COMMON  = {0, '?', true, true,
                                       {0,0,0}, {0,0,0}, {0,0,0}, 
                                       0.0, 0.0};
 
-//local helper function
-static TCOD_color_t colour_mix(TCOD_color_t colour_a, TCOD_color_t colour_b, float min, float max) {
-    float coefficient = TCOD_random_get_float(SEED, min, max);
-    return TCOD_color_lerp(colour_a, colour_b, coefficient); 
+//local helper functions
+
+//A random colour variation, for set_tile
+static guint8 random_shade() {
+    return TCOD_random_get_int(SEED, 0, 255);
+}
+
+//A shade that only depends on where the tile is, what it is and the level's shade seed - so it's 
+//the same whatever order the level is filled in. Mixing is murmur3's finaliser.
+static guint8 hashed_shade(guint32 seed, int x, int y, int type) {
+    guint32 h = seed ^ (guint32)x * 0x9E3779B1u ^ (guint32)y * 0x85EBCA77u ^ (guint32)type * 0xC2B2AE3Du;
+    
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    
+    return h >> 24;
+}
+
+//The day colour a tile with the given colour variation has - what used to be stored in Tile::day
+static TCOD_color_t day_colour(const TileSeed* tc, guint8 shade, bool visible) {
+    float coefficient = tc->min + (tc->max - tc->min) * (shade / 255.0f);
+    
+    if (visible)
+        return TCOD_color_lerp(tc->source_a_vis, tc->source_b_vis, coefficient);
+    else
+        return TCOD_color_lerp(tc->source_a, tc->source_b, coefficient);
 }
 
 //Called from outside the library
@@ -364,14 +2441,32 @@ TileSeed* create_tile_common(char sym,
     return tc; 
 }
 
+//What get_tile hands out for anything outside the level. NULL_TILE_COMMON's colours are all black,
+//so there's nothing to interpolate.
+static const Tile NULL_TILE = {
+    false,
+    false,
+    
+    0,
+    
+    '?',
+    true,
+    true,
+    
+    {0,0,0},
+    {0,0,0},
+    &NULL_TILE_COMMON.night,
+    &NULL_TILE_COMMON.night_vis };
+
 //Should not need to be used by the host, I don't think
-static Tile create_tile (const TileSeed *tc) {
-    TCOD_color_t day     = colour_mix(tc->source_a,     tc->source_b,     tc->min, tc->max);
-    TCOD_color_t day_vis = colour_mix(tc->source_a_vis, tc->source_b_vis, tc->min, tc->max);
+//Builds the Tile view of a cell, levels only store the seed and the colour variation.
+static Tile create_tile (const TileSeed *tc, guint8 shade, bool visible, bool seen) {
+    TCOD_color_t day     = day_colour(tc, shade, false);
+    TCOD_color_t day_vis = day_colour(tc, shade, true);
                                              
     const Tile tile = {
-        false, 
-        false, 
+        visible, 
+        seen, 
         
         tc->type,
         
@@ -398,6 +2493,53 @@ static guint percentage() {
 static void check_is_percentage(int ratio) {
     assert((ratio >= 0) && (ratio <= 100)); 
 }
+//Largest palette a Cell can index
+static const int MAX_PALETTE_SIZE = 65536;
+
+//Finds where a TileSeed is in the level palette, adding it the first time the level sees it.
+static guint16 palette_index(Level* l, const TileSeed* tc) {
+    //Fast path - types are unique, so this is only wrong if the host made its own TileSeeds
+    if (tc->type >= 0 && tc->type < l->palette_lookup_size) {
+        guint16 i = l->palette_lookup[tc->type];
+        if (l->palette[i] == tc)
+            return i;
+    }
+    
+    for (int i = 0; i < l->palette_size; i++) {
+        if (l->palette[i] == tc)
+            return i;
+    }
+    
+    if (l->palette_size == l->palette_capacity) {
+        if (l->palette_capacity >= MAX_PALETTE_SIZE)
+            g_error("Level palette is full, a level can only use %d TileSeeds", MAX_PALETTE_SIZE);
+        
+        l->palette_capacity *= 2;
+        l->palette = realloc(l->palette, l->palette_capacity * sizeof(TileSeed*));
+        if (l->palette == NULL)
+            g_error("realloc returned null when trying to grow the level palette");
+    }
+    
+    guint16 index = l->palette_size++;
+    l->palette[index] = tc;
+    
+    if (tc->type >= 0) {
+        if (tc->type >= l->palette_lookup_size) {
+            int size = 2 * tc->type + 1;
+            l->palette_lookup = realloc(l->palette_lookup, size * sizeof(guint16));
+            if (l->palette_lookup == NULL)
+                g_error("realloc returned null when trying to grow the palette lookup");
+            
+            memset(l->palette_lookup + l->palette_lookup_size, 0, 
+                   (size - l->palette_lookup_size) * sizeof(guint16));
+            l->palette_lookup_size = size;
+        }
+        l->palette_lookup[tc->type] = index;
+    }
+    
+    return index;
+}
+
 static bool outside_world_p(Level* l, int x, int y) {
     if (x < 0 || x >= l->width || y < 0 || y >= l->height)
         return true;
@@ -405,21 +2547,226 @@ static bool outside_world_p(Level* l, int x, int y) {
         return false; 
 }
 
+const Cell NULL_CELL = {0, 0};
+
+//----Paging----
+
+//A slot in the chunk cache, which holds one chunk in memory.
+typedef struct {
+    //Index of the chunk in the slot (into Level::chunks), -1 if empty
+    int chunk;
+    //Whether the chunk has been changed since it was last written to the page file
+    bool dirty;
+    //Neighbours in the LRU list, -1 at either end
+    int newer;
+    int older;
+}PageSlot;
+
+struct ChunkCache {
+    FILE* file;
+    
+    //The chunks in memory. Level::chunks points into this for every chunk that is resident.
+    Chunk* pages;
+    PageSlot* slots;
+    int capacity;
+    //Slots are filled in order until the cache is full, after that they get recycled
+    int used;
+    
+    //Most and least recently used slots
+    int newest;
+    int oldest;
+    
+    //One bit per chunk, set once the chunk has been written to the page file
+    guint8* stored;
+    
+    ChunkCacheStats stats;
+};
+
+static void lru_unlink(struct ChunkCache* cache, int slot) {
+    PageSlot* s = &cache->slots[slot];
+    
+    if (s->newer != -1) cache->slots[s->newer].older = s->older;
+    else                cache->newest = s->older;
+    if (s->older != -1) cache->slots[s->older].newer = s->newer;
+    else                cache->oldest = s->newer;
+}
+
+static void lru_push_newest(struct ChunkCache* cache, int slot) {
+    PageSlot* s = &cache->slots[slot];
+    
+    s->newer = -1;
+    s->older = cache->newest;
+    if (cache->newest != -1) cache->slots[cache->newest].newer = slot;
+    cache->newest = slot;
+    if (cache->oldest == -1) cache->oldest = slot;
+}
+
+//The page file passes 2 GiB at about half a million chunks - too far for fseek's long on 32 bit 
+//systems and Windows, so this seeks with a 64 bit offset.
+static bool seek_chunk(FILE* f, int chunk) {
+    const guint64 offset = (guint64)chunk * sizeof(Chunk);
+    
+#ifdef _WIN32
+    return _fseeki64(f, (__int64)offset, SEEK_SET) == 0;
+#else
+    if ((guint64)(off_t)offset != offset)
+        return false;
+    
+    return fseeko(f, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static void page_out(Level* l, int slot) {
+    struct ChunkCache* cache = l->cache;
+    PageSlot* s = &cache->slots[slot];
+    
+    if (s->dirty) {
+        if (!seek_chunk(cache->file, s->chunk) ||
+            fwrite(&cache->pages[slot], sizeof(Chunk), 1, cache->file) != 1)
+            g_error("Could not write chunk %d to the page file", s->chunk);
+        
+        cache->stored[s->chunk >> 3] |= 1 << (s->chunk & 7);
+        cache->stats.writes++;
+        s->dirty = false;
+    }
+}
+
+//Brings a chunk into memory, evicting the least recently used one if the cache is full.
+static Chunk* page_in(Level* l, int chunk) {
+    struct ChunkCache* cache = l->cache;
+    int slot;
+    
+    if (cache->used < cache->capacity) {
+        slot = cache->used++;
+    } else {
+        slot = cache->oldest;
+        page_out(l, slot);
+        lru_unlink(cache, slot);
+        l->chunks[cache->slots[slot].chunk] = NULL;
+        cache->stats.evictions++;
+    }
+    
+    Chunk* page = &cache->pages[slot];
+    
+    if (cache->stored[chunk >> 3] & (1 << (chunk & 7))) {
+        if (!seek_chunk(cache->file, chunk) ||
+            fread(page, sizeof(Chunk), 1, cache->file) != 1)
+            g_error("Could not read chunk %d back from the page file", chunk);
+        cache->stats.reads++;
+    } else {
+        memset(page, 0, sizeof(Chunk));
+    }
+    
+    cache->slots[slot].chunk = chunk;
+    cache->slots[slot].dirty = false;
+    lru_push_newest(cache, slot);
+    l->chunks[chunk] = page;
+    cache->stats.misses++;
+    
+    return page;
+}
+
+//Looks a chunk up in a paged level. Chunks that were never written are not brought in for reads.
+Chunk* level_paged_chunk(Level* l, int chunk, bool for_write) {
+    struct ChunkCache* cache = l->cache;
+    Chunk* page = l->chunks[chunk];
+    int slot;
+    
+    if (page != NULL) {
+        slot = page - cache->pages;
+        if (cache->newest != slot) {
+            lru_unlink(cache, slot);
+            lru_push_newest(cache, slot);
+        }
+        cache->stats.hits++;
+    } else if (for_write || (cache->stored[chunk >> 3] & (1 << (chunk & 7)))) {
+        page = page_in(l, chunk);
+        slot = page - cache->pages;
+    } else {
+        return NULL;
+    }
+    
+    if (for_write)
+        cache->slots[slot].dirty = true;
+    
+    return page;
+}
+
+//----Cells----
+
+//Reading cells is done by the inline accessors in libtsmi.h (get_cell_unchecked and friends).
+
+//Cell at a location inside the level, for writing. Allocates the chunk if it has to.
+static Cell* cell_for_write(Level* l, int x, int y) {
+    if (l->storage == LEVEL_FLAT)
+        return &l->cells[x + y * l->stride];
+    
+    int index = (x >> CHUNK_SHIFT) + (y >> CHUNK_SHIFT) * l->chunks_w;
+    if (l->storage == LEVEL_PAGED) {
+        Chunk* chunk = level_paged_chunk(l, index, true);
+        return &chunk->cells[(x & (CHUNK_SIZE - 1)) + (y & (CHUNK_SIZE - 1)) * CHUNK_SIZE];
+    }
+    
+    Chunk** chunk = &l->chunks[index];
+    if (*chunk == NULL) {
+        //Zeroed cells are null tiles, so a fresh chunk reads exactly as it did unallocated
+        *chunk = calloc(1, sizeof(Chunk));
+        if (*chunk == NULL)
+            g_error("calloc returned null when trying to allocate a level chunk");
+        l->chunks_allocated++;
+    }
+    
+    return &(*chunk)->cells[(x & (CHUNK_SIZE - 1)) + (y & (CHUNK_SIZE - 1)) * CHUNK_SIZE];
+}
+
+//TileSeed of a location, for internal use. Outside the map is the null tile (and isn't counted).
+static const TileSeed* seed_at(Level* l, int x, int y) {
+    if (!outside_world_p(l, x, y))
+        return get_tile_seed_unchecked(l, x, y);
+    else
+        return &NULL_TILE_COMMON;
+}
+
 //----External----
 
 void set_tile(Level *l, guint x, guint y, const TileSeed *tc) {
-    if (!outside_world_p(l, x, y)) 
-        l->tiles[x + y * l->width] = create_tile(tc); 
-    else
+    if (!outside_world_p(l, x, y)) {
+        Cell* cell = cell_for_write(l, x, y);
+        cell->seed  = palette_index(l, tc);
+        l->revision++;
+        cell->shade = l->hashed_shades ? hashed_shade(l->shade_seed, x, y, tc->type) : random_shade();
+        
+        //Keeping the transparency/walkability bitplanes in step, and noting down where they changed
+        if (transparent_unchecked_p(l, x, y) != !tc->opaque || 
+            walkable_unchecked_p(l, x, y)    != !tc->solid) {
+            
+            bitplane_put(l->transparent, l->row_words, x, y, !tc->opaque);
+            bitplane_put(l->walkable,    l->row_words, x, y, !tc->solid);
+            l->journal[l->epoch % LEVEL_JOURNAL_SIZE] = (Coord){x, y};
+            l->epoch++;
+        }
+    } else
         g_warning("Attempted to set a tile outside the map at %d, %d\n", x, y);
 }
 
 Tile get_tile(Level* l, guint x, guint y) {
-    if (!outside_world_p(l, x, y))    
-        return l->tiles[x + y * l->width];
-    else {        
-        printf("Creating null tile at %d, %d\n", x, y);
-        return create_tile((TileSeed*)&NULL_TILE_COMMON);
+    if (!outside_world_p(l, x, y)) {
+        const Cell* cell = get_cell_unchecked(l, x, y);
+        return create_tile(l->palette[cell->seed], 
+                           cell->shade,
+                           bitplane_get(l->visible, l->row_words, x, y),
+                           bitplane_get(l->seen,    l->row_words, x, y));
+    } else {        
+        l->oob_reads++;
+        return NULL_TILE;
+}}
+
+const TileSeed* get_tile_seed(Level* l, int x, int y) {
+    if (!outside_world_p(l, x, y))
+        return get_tile_seed_unchecked(l, x, y);
+    else {
+        l->oob_reads++;
+        return &NULL_TILE_COMMON;
 }}
 
 Tile get_tile_relative(Level* l, guint x, guint y, Coord c) {
@@ -429,14 +2776,71 @@ Tile get_tile_relative(Level* l, guint x, guint y, Coord c) {
 
 //For the player to check if location can be walked on
 bool walkable_p(Level* l, guint x, guint y) {
-    printf("destination tile is: %d Location %d/%d\n", !get_tile(l, x, y).solid, x, y);
-    return !get_tile(l, x, y).solid;
+    return !outside_world_p(l, x, y) && walkable_unchecked_p(l, x, y);
+}
+
+bool transparent_p(Level* l, int x, int y) {
+    return !outside_world_p(l, x, y) && transparent_unchecked_p(l, x, y);
+}
+
+//Walks the Bresenham line from (x0, y0) to (x1, y1), stopping at the first opaque tile in between.
+//The end points themselves don't block - you can see a wall, and see out of one.
+static bool line_of_sight_p(Level* l, int x0, int y0, int x1, int y1) {
+    TCOD_bresenham_data_t line;
+    int x = x0, y = y0;
+    
+    //A straight line stays inside any rectangle holding both its ends, so only lines with an end 
+    //off the level need checking tile by tile.
+    const bool clipped = outside_world_p(l, x0, y0) || outside_world_p(l, x1, y1);
+    
+    TCOD_line_init_mt(x0, y0, x1, y1, &line);
+    
+    while (!TCOD_line_step_mt(&x, &y, &line)) {
+        if (x == x1 && y == y1)
+            break;
+        
+        if (clipped ? !transparent_p(l, x, y) : !transparent_unchecked_p(l, x, y))
+            return false;
+    }
+    
+    return true;
+}
+
+void los_batch(Level* l, const Coord* from, const Coord* to, int count, bool* out) {
+    for (int i = 0; i < count; i++)
+        out[i] = line_of_sight_p(l, from[i].x, from[i].y, to[i].x, to[i].y);
+}
+
+//True if every tile in the rectangle (end exclusive) is in the cell array of a flat level, border
+//included - ie can be read with no bounds checks.
+static bool in_cells_p(Level* l, int start_x, int start_y, int end_x, int end_y) {
+    return l->storage == LEVEL_FLAT &&
+           start_x >= -l->border && end_x <= l->width  + l->border &&
+           start_y >= -l->border && end_y <= l->height + l->border;
+}
+
+//Offsets of the neighbours of a cell in a flat level's cell array, in DIRECTIONS order.
+static void neighbour_offsets(Level* l, int offsets[]) {
+    for (int i = 0; i < NUM_DIRECTIONS; i++)
+        offsets[i] = DIRECTIONS[i].x + DIRECTIONS[i].y * l->stride;
 }
 
 //checks if a location on the map has a neighbour of a certain type.
 static bool is_neighbour(Level* l, TileSeed neighbour, guint x, guint y) {
+    if (in_cells_p(l, x - 1, y - 1, x + 2, y + 2)) {
+        const Cell* cell = get_cell_unchecked(l, x, y);
+        int offsets[NUM_DIRECTIONS];
+        bool found = false;
+        
+        neighbour_offsets(l, offsets);
+        for (int i = 0; i < NUM_DIRECTIONS; i++)
+            found |= (l->palette[cell[offsets[i]].seed]->type == neighbour.type);
+        
+        return found;
+    }
+    
     for (int i = 0; i < NUM_DIRECTIONS; i++) {
-        if (get_tile_relative(l, x, y, DIRECTIONS[i]).type == neighbour.type)
+        if (seed_at(l, x + DIRECTIONS[i].x, y + DIRECTIONS[i].y)->type == neighbour.type)
             return true; 
         }    
     return false; 
@@ -446,8 +2850,7 @@ static guint sum_of_neighbours(Level* l, TileSeed neighbour, guint x, guint y) {
     guint sum = 0;
         
     for (int i = 0; i < NUM_DIRECTIONS; i++) {
-        Tile current = get_tile_relative(l, x, y, DIRECTIONS[i]);
-        const int type = current.type;
+        const int type = seed_at(l, x + DIRECTIONS[i].x, y + DIRECTIONS[i].y)->type;
         if (type == neighbour.type)
             sum++; 
     }    
@@ -456,15 +2859,24 @@ static guint sum_of_neighbours(Level* l, TileSeed neighbour, guint x, guint y) {
 
 //----Generators----/
 void one_tile_fill(Area* a, const TileSeed* tc) {
-                       
+    
+    PROFILE_START(generation);
+    TRACE_START(generation);
+    
     for (int y = a->start_y; y < a->end_y; y++) 
         for (int x = a->start_x; x < a->end_x; x++) 
             set_tile(a->level, x, y, tc); 
+    
+    TRACE_STOP(generation, __func__);
+    PROFILE_STOP(PROFILE_GENERATION, generation);
 }
 
 void two_tile_fill(Area* a, TileSeed* tc1, TileSeed* tc2, int ratio) {
     
     check_is_percentage(ratio);
+    PROFILE_START(generation);
+    TRACE_START(generation);
+    
     for (int y = a->start_y; y < a->end_y; y++) {
         for (int x = a->start_x; x < a->end_x; x++) {
             if (percentage() >= ratio)
@@ -473,11 +2885,16 @@ void two_tile_fill(Area* a, TileSeed* tc1, TileSeed* tc2, int ratio) {
                 set_tile(a->level, x, y, tc2); 
         }
     }
+    
+    TRACE_STOP(generation, __func__);
+    PROFILE_STOP(PROFILE_GENERATION, generation);
 }
 
 void tree_pattern_fill(Area* a, TileSeed* tree1, TileSeed* tree2, int tree_number, int tree_ratio) {
     
     check_is_percentage(tree_ratio);
+    PROFILE_START(generation);
+    TRACE_START(generation);
     
     //Dots the map with trees
     for (int i = 0; i < tree_number; i++) {
@@ -494,6 +2911,9 @@ void tree_pattern_fill(Area* a, TileSeed* tree1, TileSeed* tree2, int tree_numbe
                 set_tile(a->level, x_pos, y_pos, tree2); 
         }   
     }    
+    
+    TRACE_STOP(generation, __func__);
+    PROFILE_STOP(PROFILE_GENERATION, generation);
 }
 
 void veg_pattern_fill(Area* a,
@@ -503,6 +2923,9 @@ void veg_pattern_fill(Area* a,
                       int veg_ratio, 
                       TileSeed* avoid) {
                           
+    PROFILE_START(generation);
+    TRACE_START(generation);
+    
     //Fills map with Vegetation, where there are no tree1
     for (guint i = 0; i < veg_number; i++) {
         //TODO: I don't think I need to -1 here 
@@ -517,6 +2940,9 @@ void veg_pattern_fill(Area* a,
             }
         }
     }
+    
+    TRACE_STOP(generation, __func__);
+    PROFILE_STOP(PROFILE_GENERATION, generation);
 }
 
 //roguebasin.roguelikedevelopment.org/index.php?title=Cellular_Automata_Method_for_Generating_Random_Cave-Like_Levels
@@ -529,39 +2955,78 @@ void cellular_automata(Area *a, TileSeed *t1, TileSeed *t2, int sum_a, int sum_b
     //Breaking this seems to produce interesting results.
     //assert((sum_a + sum_b) == 9);
     
-    //using true for t1, false for t2
-    bool p[a->end_x][a->end_y];
+    Level* l = a->level;
+    const int width  = a->end_x - a->start_x;
+    const int height = a->end_y - a->start_y;
+    
+    if (width <= 0 || height <= 0)
+        return;
+    
+    PROFILE_START(generation);
+    TRACE_START(generation);
     
-    for (guint y = a->start_y; y < a->end_y; y++) {
-        for (guint x = a->start_x; x < a->end_x; x++) {
-            //if the tile is of type 1 and has 4 neighbours of type 1
-            if ((get_tile(a->level, x, y).type == t1->type) && 
-                 sum_of_neighbours(a->level, *t1, x, y) >= sum_a) {
+    //using true for t1, false for t2. On the heap, big areas were blowing the stack.
+    bool* p = malloc((size_t)width * height * sizeof(bool));
+    if (p == NULL)
+        g_error("malloc returned null when trying to allocate space for cellular_automata");
+    
+    if (in_cells_p(l, a->start_x - 1, a->start_y - 1, a->end_x + 1, a->end_y + 1)) {
+        //Every neighbour is in the cell array (thanks to the level border, or the area not 
+        //touching the edge) so this can run without any bounds checks or branches.
+        int offsets[NUM_DIRECTIONS];
+        guint8* is_t1 = malloc(l->palette_size);
+        if (is_t1 == NULL)
+            g_error("malloc returned null when trying to allocate space for cellular_automata");
+        
+        neighbour_offsets(l, offsets);
+        for (int i = 0; i < l->palette_size; i++)
+            is_t1[i] = (l->palette[i]->type == t1->type);
+        
+        for (int y = 0; y < height; y++) {
+            const Cell* row = get_cell_unchecked(l, a->start_x, a->start_y + y);
+            
+            for (int x = 0; x < width; x++) {
+                const Cell* cell = &row[x];
+                int sum = 0;
                 
-                p[x][y] = true;
-            }
-            //else if the tile is not type 1 and has 5 numbers that are
-            else if ((get_tile(a->level, x, y).type != t1->type) && 
-                      sum_of_neighbours(a->level, *t1, x, y) >= sum_b) {
+                for (int i = 0; i < NUM_DIRECTIONS; i++)
+                    sum += is_t1[cell[offsets[i]].seed];
                 
-                p[x][y] = true;
+                p[x + y * width] = is_t1[cell->seed] ? (sum >= sum_a) : (sum >= sum_b);
             }
-            //else it's of type 2
-            else {
-                p[x][y] = false;
+        }
+        free(is_t1);
+    } else {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                const int tile_x = a->start_x + x;
+                const int tile_y = a->start_y + y;
+                const guint sum  = sum_of_neighbours(l, *t1, tile_x, tile_y);
+                
+                //if the tile is of type 1 and has 4 neighbours of type 1
+                if (seed_at(l, tile_x, tile_y)->type == t1->type)
+                    p[x + y * width] = (sum >= sum_a);
+                //else if the tile is not type 1 and has 5 numbers that are
+                else
+                    p[x + y * width] = (sum >= sum_b);
             }
         }
     }
         
     //Applying the results of the above computation, as they have to be done simultaneously.
-    for (guint y = a->start_y; y < a->end_y; y++) {
-        for (guint x = a->start_x; x < a->end_x; x++) {
-            if (p[x][y])
-                set_tile(a->level, x, y, t1);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (p[x + y * width])
+                set_tile(l, a->start_x + x, a->start_y + y, t1);
             else
-                set_tile(a->level, x, y, t2); 
+                set_tile(l, a->start_x + x, a->start_y + y, t2); 
         }
     }
+    
+    free(p);
+    
+    TRACE_STOP(generation, __func__);
+    PROFILE_STOP(PROFILE_GENERATION, generation);
 }
 
 static bool my_callback(TCOD_bsp_t *node, void *userData) {   
@@ -589,35 +3054,216 @@ void rectangular_dungeon_fill(Level* l,
                               guint end_x,  
                               guint end_y) {
     
+    PROFILE_START(generation);
+    TRACE_START(generation);
+    
     //Creating a BSP tree.
     TCOD_bsp_t* root = TCOD_bsp_new_with_size(start_x, start_y, end_x, end_y);
     
     //Splits the root node 5 times
-    TCOD_bsp_split_recursive(root, NULL, 10, 2, 2, 1.0f, 1.0f);    
+    TCOD_bsp_split_recursive(root, SEED, 10, 2, 2, 1.0f, 1.0f);    
     
     TCOD_bsp_traverse_post_order(root, my_callback, l);    
+    TCOD_bsp_delete(root);
+    
+    TRACE_STOP(generation, __func__);
+    PROFILE_STOP(PROFILE_GENERATION, generation);
 }
 
 /***********
     LEVEL
 ************/
-Level* create_level(int width, int height) {
+//Level::id for the next level made. 0 is never used, so it can mean no level.
+static guint64 next_level_id = 1;
+
+//Everything create_level and create_chunked_level have in common, ie everything but the cells.
+static Level* new_level(enum LevelStorage storage, int width, int height) {
     Level* l = malloc(sizeof(Level));
-    l->tiles = malloc(width * height * (sizeof(Tile)));
-    l->width = width;
-    l->height = height;
+    if (l == NULL)
+        g_error("malloc returned null when trying to allocate space for the Level structure");
+    
+    l->storage = storage;
+    l->width   = width;
+    l->height  = height;
+    
+    l->cells            = NULL;
+    l->border           = 0;
+    l->stride           = width;
+    l->chunks           = NULL;
+    l->chunks_w         = 0;
+    l->chunks_h         = 0;
+    l->chunks_allocated = 0;
+    l->cache            = NULL;
+    l->oob_reads        = 0;
+    
+    l->palette_capacity    = 16;
+    l->palette_size        = 1;
+    l->palette             = malloc(l->palette_capacity * sizeof(TileSeed*));
+    l->palette_lookup_size = 0;
+    l->palette_lookup      = NULL;
+    
+    //All zero is right for a level of null tiles - not visible, not seen, opaque and solid
+    l->row_words   = (width + 63) / 64;
+    l->visible     = calloc((size_t)l->row_words * height, sizeof(guint64));
+    l->seen        = calloc((size_t)l->row_words * height, sizeof(guint64));
+    l->transparent = calloc((size_t)l->row_words * height, sizeof(guint64));
+    l->walkable    = calloc((size_t)l->row_words * height, sizeof(guint64));
+    
+    l->epoch    = 0;
+    l->journal  = malloc(LEVEL_JOURNAL_SIZE * sizeof(Coord));
+    l->revision = 0;
+    l->id       = next_level_id++;
+    
+    l->hashed_shades = false;
+    l->shade_seed    = 0;
+    
+    if (l->palette == NULL || l->visible == NULL || l->seen == NULL || l->transparent == NULL ||
+        l->walkable == NULL || l->journal == NULL)
+        g_error("Could not allocate space for a %d by %d level", width, height);
+    
+    l->palette[0] = &NULL_TILE_COMMON;
+    
+    return l;
+}
+
+Level* create_padded_level(int width, int height, int border) {
+    assert((border >= 0) && (border <= MAX_LEVEL_BORDER));
+    
+    Level* l = new_level(LEVEL_FLAT, width, height);
+    l->border = border;
+    l->stride = width + 2 * border;
+    
+    //Palette index 0 is the null tile, so zeroed cells are already a level full of dummy tiles..
+    //safer than dealing with "real" null tiles. That goes for the border too.
+    Cell* storage = calloc((size_t)l->stride * (height + 2 * border), sizeof(Cell));
+    if (storage == NULL)
+        g_error("Could not allocate space for a %d by %d level", width, height);
+    
+    l->cells = storage + border + border * l->stride;
+    
+    return l;
+}
+
+Level* create_level(int width, int height) {
+    return create_padded_level(width, height, 0);
+}
+
+static void init_chunk_table(Level* l) {
+    l->chunks_w = (l->width  + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    l->chunks_h = (l->height + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    l->chunks   = calloc((size_t)l->chunks_w * l->chunks_h, sizeof(Chunk*));
+    if (l->chunks == NULL)
+        g_error("Could not allocate the chunk table for a %d by %d level", l->width, l->height);
+}
+
+Level* create_chunked_level(int width, int height) {
+    Level* l = new_level(LEVEL_CHUNKED, width, height);
+    init_chunk_table(l);
+    
+    return l;
+}
+
+Level* create_paged_level(int width, int height, int max_chunks, const char* page_file) {
+    assert(max_chunks > 0);
+    
+    Level* l = new_level(LEVEL_PAGED, width, height);
+    init_chunk_table(l);
+    
+    struct ChunkCache* cache = calloc(1, sizeof(struct ChunkCache));
+    if (cache == NULL)
+        g_error("calloc returned null when trying to allocate a chunk cache");
     
-    //Fill map with dummy tiles..safer than dealing with "real" null tiles    
-    one_tile_fill(&(Area){l, 0, 0, width, height}, &NULL_TILE_COMMON);
+    cache->file     = (page_file != NULL) ? fopen(page_file, "w+b") : tmpfile();
+    cache->capacity = max_chunks;
+    cache->used     = 0;
+    cache->newest   = -1;
+    cache->oldest   = -1;
+    cache->pages    = malloc((size_t)max_chunks * sizeof(Chunk));
+    cache->slots    = malloc((size_t)max_chunks * sizeof(PageSlot));
+    cache->stored   = calloc(((size_t)l->chunks_w * l->chunks_h + 7) / 8, 1);
+    
+    if (cache->file == NULL)
+        g_error("Could not open the page file %s", page_file ? page_file : "(temporary)");
+    if (cache->pages == NULL || cache->slots == NULL || cache->stored == NULL)
+        g_error("Could not allocate a chunk cache of %d chunks", max_chunks);
+    
+    l->cache = cache;
     
     return l;
 }
 
+void level_set_shade_seed(Level* l, guint32 seed) {
+    l->hashed_shades = true;
+    l->shade_seed    = seed;
+}
+
+void level_sync(Level* l) {
+    if (l->storage != LEVEL_PAGED)
+        return;
+    
+    for (int slot = 0; slot < l->cache->used; slot++)
+        page_out(l, slot);
+    fflush(l->cache->file);
+}
+
+ChunkCacheStats level_cache_stats(Level* l) {
+    if (l->storage == LEVEL_PAGED)
+        return l->cache->stats;
+    else
+        return (ChunkCacheStats){0, 0, 0, 0, 0};
+}
+
+void level_reset_cache_stats(Level* l) {
+    if (l->storage == LEVEL_PAGED)
+        l->cache->stats = (ChunkCacheStats){0, 0, 0, 0, 0};
+}
+
 void delete_level(Level* l) {
-    free(l->tiles);
+    if (l->storage == LEVEL_PAGED) {
+        //Resident chunks all live in the cache's pages
+        fclose(l->cache->file);
+        free(l->cache->pages);
+        free(l->cache->slots);
+        free(l->cache->stored);
+        free(l->cache);
+        free(l->chunks);
+    } else if (l->chunks != NULL) {
+        for (int i = 0; i < l->chunks_w * l->chunks_h; i++)
+            free(l->chunks[i]);
+        free(l->chunks);
+    }
+    if (l->cells != NULL)
+        free(l->cells - (l->border + l->border * l->stride));
+    free(l->palette);
+    free(l->palette_lookup);
+    free(l->visible);
+    free(l->seen);
+    free(l->transparent);
+    free(l->walkable);
+    free(l->journal);
+    
+    //The render thread might be drawing it, and another level could turn up at the same address
+    render_end();
+    if (shade_table.level == l)
+        shade_table.level = NULL;
+    if (screen.last.level == l)
+        screen.last.level = NULL;
+    
     free(l);
 }
 
+//TCOD_path_func_t reading the walkability bitplane. Only the destination of a step matters.
+static float level_path_cost(int from_x, int from_y, int to_x, int to_y, void* user_data) {
+    (void)from_x;
+    (void)from_y;
+    
+    return walkable_p((Level*)user_data, to_x, to_y) ? 1.0f : 0.0f;
+}
+
+TCOD_path_t create_level_path(Level* l, float diagonal_cost) {
+    return TCOD_path_new_using_function(l->width, l->height, level_path_cost, l, diagonal_cost);
+}
+
 /**********
     BSP
 **********/
@@ -655,11 +3301,7 @@ void create_bsp_tree(BSP_node* parent,
         g_error("Recursion too deep: terminated");
     }    
     
-    //TODO: delete this, hard coded values, for testing only.
-    assert(0 <= parent->start_x <= 55);
-    assert(0 <= parent->start_y <= 55);
-    assert(0 <= parent->end_x <= 55);
-    assert(0 <= parent->end_y <= 55);
+    TRACE_START(bsp);
     
     //these values bound the location of the splitting hyperplane.                           
     int min_x = parent->start_x + min_width;
@@ -667,11 +3309,6 @@ void create_bsp_tree(BSP_node* parent,
     int min_y = parent->start_y + min_height;
     int max_y = parent->end_y   - min_height;
     
-    printf("min_x: %d | ", min_x);
-    printf("max_x: %d | ", max_x);
-    printf("min_y: %d | ", min_y);
-    printf("max_y: %d\n",  max_y);
-    
     bool a = max_x <= min_x;
     bool b = max_y <= min_y;
     bool c = (parent->end_x - parent->start_x) <= min_width;
@@ -679,8 +3316,8 @@ void create_bsp_tree(BSP_node* parent,
     
     //Room is too small so exit function
     if (a || b || c || d) {
-        printf("room is too small - recursion exited\n");        
         *leaves = g_list_append(*leaves, parent);
+        TRACE_STOP(bsp, __func__);
         return;
     } 
     //Construct the tree
@@ -695,7 +3332,6 @@ void create_bsp_tree(BSP_node* parent,
         
         //Horizontal split
         if (is_horizontal) {           
-            printf("Horizontal split\n");
             hyperplane = TCOD_random_get_int(SEED, min_y, max_y);
             
             left_area = (Area){parent->level, 
@@ -716,7 +3352,6 @@ void create_bsp_tree(BSP_node* parent,
         } 
         //Vertical split
         else {           
-            printf("Vertical split\n");
             hyperplane = TCOD_random_get_int(SEED, min_x, max_x);
             
             left_area = (Area){parent->level,
@@ -736,8 +3371,6 @@ void create_bsp_tree(BSP_node* parent,
             right = create_bsp_node(&right_area, NULL, NULL);
         }
         
-        printf("Hyperplane at %d\n", hyperplane);
-        
         //Assigning newly created nodes to the parent node.
         parent->left  = (struct BSP_node*)left;
         parent->right = (struct BSP_node*)right;        
@@ -746,6 +3379,8 @@ void create_bsp_tree(BSP_node* parent,
         create_bsp_tree(left,  min_width, min_height, leaves);
         create_bsp_tree(right, min_width, min_height, leaves);              
     }
+    
+    TRACE_STOP(bsp, __func__);
 }
 
 void carve_rectangular_room (gpointer element_data, gpointer user_data) {   
@@ -0,0 +1,399 @@
+/***************************************************************************************************
+    Copyright 2011 Lewis Potter
+
+    This file is part of libtsmi.
+
+    libtsmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libtsmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libtsmi.  If not, see <http://www.gnu.org/licenses/>.
+***************************************************************************************************/
+
+/*
+    tsmi_bench - times the engine on a fixed set of scenarios, headless, with everything seeded so
+    each run does exactly the same work. One line of JSON per scenario goes to stdout:
+
+        {"name":"fov/r10","ops":52100,"ns_per_op":3841.2,"cells_per_s":115467891.0}
+
+    cells_per_s is tiles worked on a second - screen cells for render, the FOV window for fov,
+    the area for generation, placements for the pattern fills, moves for creature_move, and 
+    creatures for creature_turn (all of them moving, then compute_fov_batch).
+
+    Usage: tsmi_bench [-s seed] [-t seconds per scenario] [name filter]
+*/
+
+//For clock_gettime
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libtsmi.h"
+
+static guint32 seed     = 1;
+static double  min_time = 0.25;
+static const char* filter = NULL;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+//What a scenario times: op is called with 0, 1, 2... until min_time has gone by
+typedef void (*BenchOp)(void* data, long i);
+
+static bool wanted_p(const char* name) {
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static void measure(const char* name, double cells_per_op, BenchOp op, void* data) {
+    long ops = 0;
+    const double start = now();
+    double taken = 0.0;
+    
+    //Checking the clock every op would cost more than some of the ops
+    for (long batch = 1; taken < min_time; batch *= 2) {
+        for (long i = 0; i < batch; i++)
+            op(data, ops + i);
+    
+        ops  += batch;
+        taken = now() - start;
+    }
+    
+    printf("{\"name\":\"%s\",\"ops\":%ld,\"ns_per_op\":%.1f,\"cells_per_s\":%.1f}\n",
+           name, ops, taken * 1e9 / ops, cells_per_op * ops / taken);
+    fflush(stdout);
+}
+
+/*************
+    LEVELS
+*************/
+
+static TileSeed* floor_tile;
+static TileSeed* wall_tile;
+static TileSeed* tree_tile;
+static TileSeed* bush_tile;
+static TileSeed* grass_tile;
+
+static void make_tiles(void) {
+    const TCOD_color_t day_a = {90, 140, 60}, day_b = {120, 180, 80}, night = {10, 20, 40};
+    const TCOD_color_t vis_a = {110, 170, 70}, vis_b = {150, 210, 100}, night_vis = {30, 40, 70};
+    
+    floor_tile = create_tile_common('.', false, false, day_a, day_b, night, vis_a, vis_b,
+                                    night_vis, 0.2f, 0.8f);
+    wall_tile  = create_tile_common('#', true,  true,  day_a, day_b, night, vis_a, vis_b,
+                                    night_vis, 0.0f, 0.5f);
+    tree_tile  = create_tile_common('T', true,  true,  day_a, day_b, night, vis_a, vis_b,
+                                    night_vis, 0.1f, 0.9f);
+    bush_tile  = create_tile_common('"', false, true,  day_a, day_b, night, vis_a, vis_b,
+                                    night_vis, 0.3f, 0.7f);
+    grass_tile = create_tile_common(',', false, false, day_a, day_b, night, vis_a, vis_b,
+                                    night_vis, 0.4f, 0.6f);
+}
+
+//Mostly open ground with scattered walls and trees - something for FOV to work around
+static Level* make_field(int width, int height) {
+    set_random_seed(seed);
+    
+    Level* l = create_level(width, height);
+    Area a = {l, 0, 0, width, height};
+    
+    two_tile_fill(&a, floor_tile, grass_tile, 30);
+    tree_pattern_fill(&a, tree_tile, wall_tile, width * height / 40, 50);
+    
+    return l;
+}
+
+/*************
+    RENDER
+*************/
+
+typedef struct {
+    Level* level;
+    Creature* pc;
+    const FovMask* fov;
+    Coord camera;
+}RenderBench;
+
+//The time of day changes every frame, so every cell has to be drawn again
+static void render_op(void* data, long i) {
+    RenderBench* b = data;
+    render_with_fov(b->level, &b->camera, b->pc, b->fov, (i % 97) / 96.0f, true);
+}
+
+static void bench_render(int width, int height) {
+    char name[64];
+    snprintf(name, sizeof(name), "render/%dx%d", width, height);
+    
+    if (!wanted_p(name))
+        return;
+    
+    init_screen_globals(width, height);
+    
+    const TCOD_color_t white = {255, 255, 255}, black = {0, 0, 0};
+    RenderBench b;
+    
+    b.level  = make_field(width * 2, height * 2);
+    b.pc     = create_creature('@', width, height, North, white, black, 20, b.level);
+    b.fov    = compute_fov(b.pc, false);
+    b.camera = (Coord){width / 2, height / 2};
+    
+    measure(name, (double)width * height, render_op, &b);
+    
+    delete_creature(b.pc);
+    delete_level(b.level);
+}
+
+/**********
+    FOV
+**********/
+
+//Steps back and forth so the FOV is never cached
+static void fov_op(void* data, long i) {
+    Creature* c = data;
+    creature_move(c, (i & 1) ? -1 : 1, 0);
+    compute_fov(c, false);
+}
+
+static void bench_fov(int radius) {
+    char name[64];
+    snprintf(name, sizeof(name), "fov/r%d", radius);
+    
+    if (!wanted_p(name))
+        return;
+    
+    const TCOD_color_t white = {255, 255, 255}, black = {0, 0, 0};
+    Level* l = make_field(256, 256);
+    
+    //Somewhere it can step both ways
+    set_tile(l, 127, 128, floor_tile);
+    set_tile(l, 128, 128, floor_tile);
+    set_tile(l, 129, 128, floor_tile);
+    
+    Creature* c = create_creature('@', 128, 128, North, white, black, radius, l);
+    
+    measure(name, (2.0 * radius + 1) * (2.0 * radius + 1), fov_op, c);
+    
+    delete_creature(c);
+    delete_level(l);
+}
+
+/*****************
+    GENERATION
+*****************/
+
+typedef struct {
+    Area area;
+    int count;
+    int ratio;
+}FillBench;
+
+static void cellular_op(void* data, long i) {
+    FillBench* b = data;
+    (void)i;
+    cellular_automata(&b->area, wall_tile, floor_tile, 5, 4);
+}
+
+static void bench_cellular(int size) {
+    char name[64];
+    snprintf(name, sizeof(name), "cellular_automata/%dx%d", size, size);
+    
+    if (!wanted_p(name))
+        return;
+    
+    set_random_seed(seed);
+    
+    FillBench b;
+    b.area = (Area){create_level(size, size), 0, 0, size, size};
+    two_tile_fill(&b.area, wall_tile, floor_tile, 45);
+    
+    measure(name, (double)size * size, cellular_op, &b);
+    
+    delete_level(b.area.level);
+}
+
+static void tree_op(void* data, long i) {
+    FillBench* b = data;
+    (void)i;
+    tree_pattern_fill(&b->area, tree_tile, wall_tile, b->count, b->ratio);
+}
+
+static void veg_op(void* data, long i) {
+    FillBench* b = data;
+    (void)i;
+    veg_pattern_fill(&b->area, bush_tile, grass_tile, b->count, b->ratio, tree_tile);
+}
+
+//Placements per call are `percent` of the area
+static void bench_pattern(const char* kind, BenchOp op, int percent) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s/%d%%", kind, percent);
+    
+    if (!wanted_p(name))
+        return;
+    
+    const int size = 512;
+    
+    set_random_seed(seed);
+    
+    FillBench b;
+    b.area  = (Area){create_level(size, size), 0, 0, size, size};
+    b.count = size * size / 100 * percent;
+    b.ratio = 50;
+    one_tile_fill(&b.area, floor_tile);
+    
+    measure(name, b.count, op, &b);
+    
+    delete_level(b.area.level);
+}
+
+static void dungeon_op(void* data, long i) {
+    FillBench* b = data;
+    Level* l = b->area.level;
+    (void)i;
+    
+    rectangular_dungeon_fill(l, 0, 0, l->width, l->height);
+}
+
+static void bench_dungeon(int size) {
+    char name[64];
+    snprintf(name, sizeof(name), "bsp_dungeon/%dx%d", size, size);
+    
+    if (!wanted_p(name))
+        return;
+    
+    set_random_seed(seed);
+    
+    FillBench b;
+    b.area = (Area){create_level(size, size), 0, 0, size, size};
+    one_tile_fill(&b.area, wall_tile);
+    
+    measure(name, (double)size * size, dungeon_op, &b);
+    
+    delete_level(b.area.level);
+}
+
+/****************
+    CREATURES
+****************/
+
+static const Coord STEPS[8] = {NORTH, NORTHEAST, EAST, SOUTHEAST, SOUTH, SOUTHWEST, WEST, NORTHWEST};
+
+typedef struct {
+    Creature** creatures;
+    int count;
+    guint32 random;
+}CreatureBench;
+
+//Each op moves the next creature a step in a random direction
+static void creature_op(void* data, long i) {
+    CreatureBench* b = data;
+    
+    b->random ^= b->random << 13;
+    b->random ^= b->random >> 17;
+    b->random ^= b->random << 5;
+    
+    const Coord d = STEPS[b->random % 8];
+    creature_move(b->creatures[i % b->count], d.x, d.y);
+}
+
+//Each op is a turn: every creature moves, then they all look around
+static void turn_op(void* data, long i) {
+    CreatureBench* b = data;
+    
+    for (int c = 0; c < b->count; c++)
+        creature_op(b, i * b->count + c);
+    
+    compute_fov_batch(b->creatures, b->count, false);
+}
+
+static void bench_creatures(const char* kind, BenchOp op, int count) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s/%d", kind, count);
+    
+    if (!wanted_p(name))
+        return;
+    
+    const TCOD_color_t white = {255, 255, 255}, black = {0, 0, 0};
+    Level* l = make_field(512, 512);
+    
+    CreatureBench b;
+    b.creatures = malloc(count * sizeof(Creature*));
+    b.count     = count;
+    b.random    = seed | 1;
+    
+    if (b.creatures == NULL)
+        g_error("Could not allocate %d creatures", count);
+    
+    for (int i = 0; i < count; i++)
+        b.creatures[i] = create_creature('g', i * 7919 % 512, i * 104729 % 512, North, white,
+                                         black, 8, l);
+    
+    measure(name, (op == creature_op) ? 1.0 : count, op, &b);
+    
+    for (int i = 0; i < count; i++)
+        delete_creature(b.creatures[i]);
+    
+    free(b.creatures);
+    delete_level(l);
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            seed = (guint32)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            min_time = atof(argv[++i]);
+        else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: %s [-s seed] [-t seconds per scenario] [name filter]\n",
+                    argv[0]);
+            return 1;
+        } else
+            filter = argv[i];
+    }
+    
+    init_screen_globals(80, 50);
+    init_headless();
+    make_tiles();
+    
+    bench_render(80, 50);
+    bench_render(160, 100);
+    bench_render(320, 200);
+    
+    bench_fov(5);
+    bench_fov(10);
+    bench_fov(20);
+    
+    for (int size = 256; size <= 4096; size *= 2)
+        bench_cellular(size);
+    
+    const int densities[] = {1, 5, 20};
+    
+    for (int i = 0; i < 3; i++)
+        bench_pattern("tree_pattern_fill", tree_op, densities[i]);
+    
+    for (int i = 0; i < 3; i++)
+        bench_pattern("veg_pattern_fill", veg_op, densities[i]);
+    
+    bench_dungeon(256);
+    
+    bench_creatures("creature_move", creature_op, 100);
+    bench_creatures("creature_move", creature_op, 10000);
+    bench_creatures("creature_turn", turn_op, 1000);
+    
+    stop_fov_workers();
+    
+    return 0;
+}
@@ -0,0 +1,347 @@
+/***************************************************************************************************
+    Copyright 2011 Lewis Potter
+
+    This file is part of libtsmi.
+
+    libtsmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    libtsmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with libtsmi.  If not, see <http://www.gnu.org/licenses/>.
+***************************************************************************************************/
+
+/*
+    tsmi_fovcheck - checks compute_fov on seeded random maps, headless. For each trial it makes a
+    level, then moves, turns and edits around a creature, working out its FOV every step:
+
+    - FOV is checked tile by tile against libtcod's own FOV_SHADOW (TCOD_map_compute_fov). Cones
+      are checked against it too, cut down to the tiles inside the cone.
+    - Levels are flat, padded, chunked or paged, picked at random for each trial.
+    - A second creature with incremental_fov set goes through the same steps, and has to end up
+      with exactly the same mask every time.
+
+    Anything that doesn't match is reported on stderr, and the exit status is 1. Every trial also
+    prints a digest of all the masks it made to stdout, so the bit-parallel shadowcaster and the
+    TSMI_SCALAR_FOV one can be held to each other by building both and comparing the output:
+
+        ./tsmi_fovcheck > fast.txt && ./tsmi_fovcheck_scalar > scalar.txt
+        cmp fast.txt scalar.txt
+
+    Usage: tsmi_fovcheck [-s seed] [-n trials]
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libtsmi.h"
+
+static guint32 seed   = 1;
+static int     trials = 400;
+
+static guint32 random_state;
+
+static int random_below(int n) {
+    random_state = random_state * 1664525u + 1013904223u;
+    return (int)((random_state >> 8) % (guint32)n);
+}
+
+/***************
+    REFERENCE
+***************/
+
+//A copy of the transparency under m, with libtcod's FOV_SHADOW worked out on it
+static TCOD_map_t reference_fov(Creature* c, const FovMask* m) {
+    TCOD_map_t map = TCOD_map_new(m->width, m->height);
+    
+    for (int y = 0; y < m->height; y++)
+        for (int x = 0; x < m->width; x++)
+            TCOD_map_set_properties(map, x, y, transparent_p(c->current_level, m->x + x, m->y + y),
+                                    true);
+    
+    TCOD_map_compute_fov(map, c->x - m->x, c->y - m->y, c->radius, true, FOV_SHADOW);
+    
+    return map;
+}
+
+//Compass bearing of an offset in degrees, clockwise from north (-y), as tsmi.c has it
+static double bearing(double dx, double dy) {
+    return atan2(dx, -dy) * 180.0 / G_PI;
+}
+
+//An angle in degrees, brought into (-180, 180].
+static double wrap_degrees(double a) {
+    a = fmod(a, 360.0);
+    
+    if (a > 180.0)
+        a -= 360.0;
+    else if (a <= -180.0)
+        a += 360.0;
+    
+    return a;
+}
+
+//Where a tile stands against a creature's cone
+enum ConeSide {
+    INSIDE_CONE,
+    OUTSIDE_CONE,
+    CONE_EDGE
+};
+
+//A little slack either side of the cone's edges, for tanf and float slopes in the shadowcaster
+static const double CONE_SLACK = 1e-3;
+
+/*
+    Whether the whole of the tile dx, dy from the creature (as seen from the middle of the 
+    creature's tile) is within half_width degrees of facing, none of it is, or an edge of the 
+    cone passes through it.
+*/
+static enum ConeSide cone_side(int dx, int dy, double facing, double half_width) {
+    const double centre = wrap_degrees(bearing(dx, dy) - facing);
+    double lo = centre;
+    double hi = centre;
+    
+    for (int corner = 0; corner < 4; corner++) {
+        const double x = dx + ((corner & 1) ? 0.5 : -0.5);
+        const double y = dy + ((corner & 2) ? 0.5 : -0.5);
+        const double off = centre + wrap_degrees(bearing(x, y) - bearing(dx, dy));
+        
+        lo = fmin(lo, off);
+        hi = fmax(hi, off);
+    }
+    
+    if (lo >= -half_width + CONE_SLACK && hi <= half_width - CONE_SLACK)
+        return INSIDE_CONE;
+    
+    //The span can go a little past +-180, so try it a turn either way too
+    for (int wrap = -360; wrap <= 360; wrap += 360)
+        if (lo + wrap <= half_width + CONE_SLACK && hi + wrap >= -half_width - CONE_SLACK)
+            return CONE_EDGE;
+    
+    return OUTSIDE_CONE;
+}
+
+/*
+    Counts the tiles in m that disagree with the reference: libtcod's FOV_SHADOW for full circle.
+    For a cone, tiles wholly inside it have to match FOV_SHADOW, and tiles wholly outside it have
+    to be dark.
+    
+    Tiles an edge of the cone passes through aren't checked. The shadowcaster starts a cone's 
+    scan afresh at the edge's slope, and lights any tile the scan passes through, centre inside 
+    or not; libtcod's full circle scan gets to the same tile by its own lopsided tile slopes, and
+    can leave it dark where the cone's scan lights it. Neither is wrong.
+*/
+static int reference_mismatches(Creature* c, const FovMask* m, bool cone) {
+    TCOD_map_t map = reference_fov(c, m);
+    
+    const bool narrow = cone && c->fov_half_width < 180.0f;
+    const int cx = c->x - m->x;
+    const int cy = c->y - m->y;
+    int mismatches = 0;
+    
+    for (int y = 0; y < m->height; y++) {
+        for (int x = 0; x < m->width; x++) {
+            const bool seen = TCOD_map_is_in_fov(map, x, y);
+            const bool lit  = fov_mask_get(m, m->x + x, m->y + y);
+            
+            if (!narrow || (x == cx && y == cy)) {
+                mismatches += (lit != seen);
+                continue;
+            }
+            
+            switch (cone_side(x - cx, y - cy, c->direction * 45.0, c->fov_half_width)) {
+                case INSIDE_CONE:
+                    mismatches += (lit != seen);
+                    break;
+                case OUTSIDE_CONE:
+                    mismatches += lit;
+                    break;
+                case CONE_EDGE:
+                    break;
+            }
+        }
+    }
+    
+    TCOD_map_delete(map);
+    
+    return mismatches;
+}
+
+/************
+    CHECK
+************/
+
+//FNV-1a over where a mask is and every bit in it
+static guint64 mask_digest(const FovMask* m, guint64 h) {
+    const int header[4] = {m->x, m->y, m->width, m->height};
+    
+    for (int i = 0; i < 4; i++) {
+        h ^= (guint32)header[i];
+        h *= G_GUINT64_CONSTANT(1099511628211);
+    }
+    
+    for (int y = 0; y < m->height; y++) {
+        for (int x = 0; x < m->width; x++) {
+            h ^= fov_mask_get(m, m->x + x, m->y + y);
+            h *= G_GUINT64_CONSTANT(1099511628211);
+        }
+    }
+    
+    return h;
+}
+
+static bool masks_equal_p(const FovMask* a, const FovMask* b) {
+    if (a->x != b->x || a->y != b->y || a->width != b->width || a->height != b->height)
+        return false;
+    
+    for (int y = 0; y < a->height; y++)
+        for (int x = 0; x < a->width; x++)
+            if (fov_mask_get(a, a->x + x, a->y + y) != fov_mask_get(b, b->x + x, b->y + y))
+                return false;
+    
+    return true;
+}
+
+static const char* LAYOUT_NAMES[4] = {"flat", "padded", "chunked", "paged"};
+
+//One of the ways a level can be stored, so FOV gets checked against each
+static Level* make_level(int layout, int width, int height) {
+    switch (layout) {
+        case 1:
+            return create_padded_level(width, height, 1 + random_below(MAX_LEVEL_BORDER));
+        case 2:
+            return create_chunked_level(width, height);
+        case 3:
+            //Few enough chunks in memory that they keep getting paged out
+            return create_paged_level(width, height, 1 + random_below(8), NULL);
+        default:
+            return create_level(width, height);
+    }
+}
+
+static const int STEP_X[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+static const int STEP_Y[8] = {-1, -1, 0, 1, 1, 1, 0, -1};
+
+//Runs one trial, returning how many problems it found
+static int check_trial(int trial, TileSeed* floor_tile, TileSeed* wall_tile) {
+    const int width   = 20 + random_below(200);
+    const int height  = 20 + random_below(200);
+    const int walls   = random_below(50);
+    const int radius  = random_below(8) == 0 ? 0 : 1 + random_below(60);
+    const bool cone   = random_below(2) == 0;
+    const int layout  = random_below(4);
+    
+    Level* l = make_level(layout, width, height);
+    
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            set_tile(l, x, y, random_below(100) < walls ? wall_tile : floor_tile);
+    
+    const TCOD_color_t white = {255, 255, 255}, black = {0, 0, 0};
+    const int x = random_below(width);
+    const int y = random_below(height);
+    
+    Creature* plain = create_creature('@', x, y, North, white, black, radius, l);
+    Creature* incremental = create_creature('@', x, y, North, white, black, radius, l);
+    incremental->incremental_fov = true;
+    
+    guint64 digest = G_GUINT64_CONSTANT(14695981039346656037);
+    int problems = 0;
+    
+    for (int step = 0; step < 40; step++) {
+        const int op = random_below(10);
+        
+        //Mostly walking, since that's what incremental FOV has to get right the most
+        if (op < 4) {
+            const int d = random_below(8);
+            const int to_x = plain->x + STEP_X[d];
+            const int to_y = plain->y + STEP_Y[d];
+            
+            if (to_x >= 0 && to_y >= 0 && to_x < width && to_y < height) {
+                plain->x = incremental->x = to_x;
+                plain->y = incremental->y = to_y;
+            }
+        } else if (op < 6) {
+            const bool left = random_below(2) == 0;
+            creature_turn(plain, left);
+            creature_turn(incremental, left);
+        } else if (op < 9) {
+            const int reach = (radius > 0) ? radius : 20;
+            const int to_x = plain->x + random_below(2 * reach + 1) - reach;
+            const int to_y = plain->y + random_below(2 * reach + 1) - reach;
+            
+            if (to_x >= 0 && to_y >= 0 && to_x < width && to_y < height)
+                set_tile(l, to_x, to_y, random_below(2) == 0 ? wall_tile : floor_tile);
+        } else {
+            plain->fov_half_width = incremental->fov_half_width = (float)random_below(200);
+        }
+        
+        const FovMask* m = compute_fov(plain, cone);
+        const FovMask* n = compute_fov(incremental, cone);
+        
+        digest = mask_digest(m, digest);
+        
+        if (!masks_equal_p(m, n)) {
+            fprintf(stderr, "trial %d step %d: incremental FOV differs\n", trial, step);
+            problems++;
+        }
+        
+        const int mismatches = reference_mismatches(plain, m, cone);
+        
+        if (mismatches > 0) {
+            fprintf(stderr, "trial %d step %d: %d tiles differ from the reference\n",
+                    trial, step, mismatches);
+            problems++;
+        }
+    }
+    
+    printf("trial %d: %s %dx%d, %d%% walls, radius %d, %s: %016llx\n", trial, 
+           LAYOUT_NAMES[layout], width, height, walls, radius, cone ? "cone" : "full circle", 
+           (unsigned long long)digest);
+    
+    delete_creature(plain);
+    delete_creature(incremental);
+    delete_level(l);
+    
+    return problems;
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            seed = (guint32)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            trials = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "Usage: %s [-s seed] [-n trials]\n", argv[0]);
+            return 1;
+        }
+    }
+    
+    init_screen_globals(80, 50);
+    init_headless();
+    
+    const TCOD_color_t day = {90, 140, 60}, night = {10, 20, 40};
+    TileSeed* floor_tile = create_tile_common('.', false, false, day, day, night, day, day,
+                                              night, 0.0f, 1.0f);
+    TileSeed* wall_tile  = create_tile_common('#', true,  true,  day, day, night, day, day,
+                                              night, 0.0f, 1.0f);
+    
+    random_state = seed;
+    int problems = 0;
+    
+    for (int t = 0; t < trials; t++)
+        problems += check_trial(t, floor_tile, wall_tile);
+    
+    fprintf(stderr, "%d trials, %d problems\n", trials, problems);
+    
+    return problems > 0;
+}